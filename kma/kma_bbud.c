@@ -0,0 +1,278 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the buddy system,
+ *             with the state of every page kept in bitmaps
+ *    Author: Stefan Birrer
+ *    Copyright: 2004 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  ChangeLog:
+ * -------------------------------------------------------------------------
+ *    Revision 1.2  2009/10/31 21:28:52  jot836
+ *    This is the current version of KMA project 3.
+ *    It includes:
+ *    - the most up-to-date handout (F'09)
+ *    - updated skeleton including
+ *        file-driven test harness,
+ *        trace generator script,
+ *        support for evaluating efficiency of algorithm (wasted memory),
+ *        gnuplot support for plotting allocation and waste,
+ *        set of traces for all students to use (including a makefile and README of the settings),
+ *    - different version of the testsuite for use on the submission site, including:
+ *        scoreboard Python scripts, which posts the top 5 scores on the course webpage
+ *
+ *    Revision 1.1  2005/10/24 16:07:09  sbirrer
+ *    - skeleton
+ *
+ *    Revision 1.2  2004/11/05 15:45:56  sbirrer
+ *    - added size as a parameter to kma_free
+ *
+ *    Revision 1.1  2004/11/03 23:04:03  sbirrer
+ *    - initial version for the kernel memory allocator project
+ *
+ ***************************************************************************/
+#ifdef KMA_BBUD
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <strings.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* A buddy system without free lists. Each page has, out of line, one
+   free bit per block of every order (16 bytes to a whole page), and a
+   mask of the orders it has a free block of. Pages with a free block of
+   an order are linked on that order's list, and a global mask says which
+   of those lists are not empty. So the buddy of a block is a bit test,
+   the order of a size is a clz, and the smallest order to split from is
+   an ffs of the global mask. Blocks carry no header; kma_free gets the
+   size. */
+
+// Smallest block: 16 bytes.
+#define MINSHIFT 4
+
+// Orders 16, 32, ..., 8192; the last one is a whole page.
+#define NUMORDERS 10
+#define PAGEORDER (NUMORDERS - 1)
+
+#define ORDERSIZE(order) (1 << (MINSHIFT + (order)))
+
+/* Bits are numbered like a heap: the whole page is bit 1, its halves
+   bits 2 and 3, and so on down to the 16 byte blocks, bits 512 to 1023.
+   The blocks of an order are bits FIRSTBIT(order) to 2 * FIRSTBIT(order)
+   - 1. */
+#define MAPBITS (1 << NUMORDERS)
+#define MAPWORDS (MAPBITS / 64)
+#define FIRSTBIT(order) (1 << (PAGEORDER - (order)))
+
+#define TESTBIT(map, bit) ((map)[(bit) / 64] & (1ULL << ((bit) % 64)))
+
+typedef struct budpage_t {
+  kma_page_t* page;
+  unsigned long long free[MAPWORDS];
+  int orders;                            // orders with a free block
+  struct budpage_t* next[NUMORDERS];     // pages with a free block of the order
+  struct budpage_t* prev[NUMORDERS];
+} budpageT;
+
+/************Global Variables*********************************************/
+
+static budpageT budpages[MAXPAGES];
+
+/* Pages with a free block of each order, and the orders whose list is
+   not empty. */
+static budpageT* orderpages[NUMORDERS];
+static int orders;
+
+/************Function Prototypes******************************************/
+
+static int size_order(kma_size_t);
+static int block_bit(void*, int);
+static void* bit_block(budpageT*, int, int);
+static int find_free(budpageT*, int);
+static void set_free(budpageT*, int, int);
+static void clear_free(budpageT*, int, int);
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+/* Splits the first free block of the smallest order at least as large as
+   the request, getting a new page when no order has one. */
+void*
+kma_malloc(kma_size_t size)
+{
+  budpageT* budpage;
+  int order, found, bit;
+
+  if (size <= 0 || size > PAGESIZE)
+    return NULL;
+
+  order = size_order(size);
+  if ((orders >> order) == 0)
+    {
+      kma_page_t* page = get_page();
+
+      budpage = &budpages[page_index(page->ptr)];
+      budpage->page = page;
+      set_free(budpage, PAGEORDER, FIRSTBIT(PAGEORDER));
+    }
+
+  found = order + ffs(orders >> order) - 1;
+  budpage = orderpages[found];
+  bit = find_free(budpage, found);
+  clear_free(budpage, found, bit);
+
+  // the halves of a block are bits 2 * bit and 2 * bit + 1
+  while (found > order)
+    {
+      found--;
+      bit = 2 * bit;
+      set_free(budpage, found, bit + 1);
+    }
+
+  return bit_block(budpage, order, bit);
+}
+
+/* Merges the block with its buddy for as long as the buddy is free, and
+   returns the page when all of it is. */
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  budpageT* budpage = &budpages[page_index(ptr)];
+  int order = size_order(size);
+  int bit = block_bit(ptr, order);
+
+  while (order < PAGEORDER && TESTBIT(budpage->free, bit ^ 1))
+    {
+      clear_free(budpage, order, bit ^ 1);
+      bit /= 2;
+      order++;
+    }
+
+  if (order == PAGEORDER)
+    {
+      assert(budpage->orders == 0);
+      free_page(budpage->page);
+      budpage->page = NULL;
+      return;
+    }
+
+  set_free(budpage, order, bit);
+}
+
+/* Smallest order whose blocks hold size bytes. */
+static int
+size_order(kma_size_t size)
+{
+  if (size <= ORDERSIZE(0))
+    return 0;
+  return 32 - __builtin_clz(size - 1) - MINSHIFT;
+}
+
+/* The bit of a block of an order. */
+static int
+block_bit(void* block, int order)
+{
+  int offset = (char*) block - (char*) BASEADDR(block);
+
+  return FIRSTBIT(order) + (offset >> (MINSHIFT + order));
+}
+
+/* The block of a bit of an order. */
+static void*
+bit_block(budpageT* budpage, int order, int bit)
+{
+  return (char*) budpage->page->ptr
+    + ((bit - FIRSTBIT(order)) << (MINSHIFT + order));
+}
+
+/* The first free block of an order on a page that has one. The smaller
+   orders take whole words of the bitmap, at most eight of them; the
+   larger ones share the first word. */
+static int
+find_free(budpageT* budpage, int order)
+{
+  int first = FIRSTBIT(order);
+  int word;
+
+  if (first < 64)
+    {
+      unsigned long long bits = budpage->free[0] & (((1ULL << first) - 1) << first);
+
+      assert(bits != 0);
+      return __builtin_ctzll(bits);
+    }
+
+  for (word = first / 64; word < 2 * first / 64; word++)
+    if (budpage->free[word] != 0)
+      return word * 64 + __builtin_ctzll(budpage->free[word]);
+
+  assert(0);
+  return 0;
+}
+
+/* Marks a block free, listing its page for the order if this is the
+   page's first free block of it. */
+static void
+set_free(budpageT* budpage, int order, int bit)
+{
+  budpage->free[bit / 64] |= 1ULL << (bit % 64);
+  if (budpage->orders & (1 << order))
+    return;
+
+  budpage->orders |= 1 << order;
+  budpage->prev[order] = NULL;
+  budpage->next[order] = orderpages[order];
+  if (orderpages[order] != NULL)
+    orderpages[order]->prev[order] = budpage;
+  orderpages[order] = budpage;
+  orders |= 1 << order;
+}
+
+/* Marks a block in use (or merged), unlisting its page for the order if
+   that was the page's last free block of it. */
+static void
+clear_free(budpageT* budpage, int order, int bit)
+{
+  int first = FIRSTBIT(order);
+  int word;
+
+  budpage->free[bit / 64] &= ~(1ULL << (bit % 64));
+
+  if (first < 64)
+    {
+      if (budpage->free[0] & (((1ULL << first) - 1) << first))
+        return;
+    }
+  else
+    {
+      for (word = first / 64; word < 2 * first / 64; word++)
+        if (budpage->free[word] != 0)
+          return;
+    }
+
+  budpage->orders &= ~(1 << order);
+  if (budpage->prev[order] != NULL)
+    budpage->prev[order]->next[order] = budpage->next[order];
+  else
+    orderpages[order] = budpage->next[order];
+  if (budpage->next[order] != NULL)
+    budpage->next[order]->prev[order] = budpage->prev[order];
+  if (orderpages[order] == NULL)
+    orders &= ~(1 << order);
+}
+
+#endif // KMA_BBUD
@@ -99,6 +99,11 @@ typedef struct pageheader_t {
 // Gets the malloc'ed space, given the location of the allocation.
 #define ALLOC_START(ptr) ((void*) ((long int) ptr + sizeof(allocheaderT)))
 
+// Gets the number of pages in the run for a request too big to share a
+// page: the request with its header and the page header, rounded up to
+// a power of two.
+#define RUN_PAGES(size) (round_up(REALSIZE(size) + sizeof(pageheaderT)) / PAGESIZE)
+
 /************Global Variables*********************************************/
 
 kma_page_t* first_page = NULL;
@@ -107,7 +112,7 @@ kma_page_t* first_page = NULL;
 
 // void print_pages(); debug function
 
-kma_page_t* init_page();
+kma_page_t* init_page(int);
 void* get_free_entry();
 void* get_free_buffer(int);
 freelistL* get_required_buffer(int, pageheaderT*);
@@ -161,15 +166,16 @@ int round_up(int);
 // }
 
 /* malloc function. Initializes the first page if needed, then
-   returns the appropriate allocated space. */
+   returns the appropriate allocated space. Requests that don't fit in
+   half a page get a run of pages of their own. */
 void* kma_malloc(kma_size_t size)
 {
-  if (REALSIZE(size)+sizeof(pageheaderT) > PAGESIZE)
+  if (REALSIZE(size)+sizeof(pageheaderT) > MAXPAGES * PAGESIZE)
     return NULL;
 
   if (first_page == NULL)
   {
-    first_page = init_page();
+    first_page = init_page(1);
     kma_malloc(sizeof(pageheaderT));    // mallocs the page header so it isn't overwritten.
     PAGE_HEADER(first_page)->used = 0;  // resets the allocation counter because the page
                                         // header doesn't count.
@@ -189,8 +195,8 @@ void kma_free(void* ptr, kma_size_t size)
   freelistL* buffer = get_required_buffer(size, page);
   allocheaderT* alloc = buffer->first_block;
 
-  // can't do any of this entire page is allocated to one chunk.
-  if (round_up(size) != PAGESIZE)
+  // can't do any of this entire page (or run) is allocated to one chunk.
+  if (round_up(REALSIZE(size)) < PAGESIZE)
   {
     // creating new free buffer
     allocheaderT* new_alloc = (allocheaderT*) (ptr);
@@ -256,16 +262,25 @@ void kma_free(void* ptr, kma_size_t size)
       }
       prev->next = page->next;
       free_page(page->page);
+
+      // the first page may never have held more than the page header,
+      // as when every request took a page (or run) of its own
+      if (PAGE_HEADER(first_page)->used == 0 && PAGE_HEADER(first_page)->next == NULL)
+      {
+        free_page(first_page);
+        first_page = NULL;
+      }
     }
   }
 }
 
-/* Creates the initial pageheader struct at the begnning of the page.
-   Links each of the buffers to the larger size and sets the list of free
-   buffers to be NULL, then creates a single buffer of size PAGESIZE.*/
-kma_page_t* init_page()
+/* Creates the initial pageheader struct at the begnning of the page, or
+   the first page of a run of pages. Links each of the buffers to the
+   larger size and sets the list of free buffers to be NULL, then creates
+   a single buffer of size PAGESIZE.*/
+kma_page_t* init_page(int pages)
 {
-  kma_page_t* page = get_page(); 
+  kma_page_t* page = get_pages(pages, pages); 
   pageheaderT* page_headers = PAGE_HEADER(page);
   page_headers->page = page;
   page_headers->next = NULL;
@@ -310,7 +325,9 @@ kma_page_t* init_page()
    If none of the pages can fit the requested size, a new page is
    allocated and a page header created and allocated. In the special
    case of the buffer request being > PAGESIZE/2 a new page is always
-   allocated.
+   allocated, or a naturally aligned run of 2, 4, 8, ... pages when the
+   request doesn't fit in one. kma_page merges the runs back when they
+   are freed.
 */
 void* get_free_buffer(int size)
 {
@@ -376,7 +393,7 @@ void* get_free_buffer(int size)
   }
 
   // Create a new page, split it up to insert the header.
-  kma_page_t* new_page = init_page();
+  kma_page_t* new_page = init_page(round_up(REALSIZE(size)) >= PAGESIZE ? RUN_PAGES(size) : 1);
   page_header = PAGE_HEADER(new_page);
   prev_page->next = page_header;
 
@@ -398,8 +415,8 @@ void* get_free_buffer(int size)
   buffer_size->first_block = to_be_allocated->next;
 
   // If size > PAGESIZE/2, clears free headers and allocates the
-  // whole page.
-  if (round_up(REALSIZE(size)) == PAGESIZE)
+  // whole page (or run).
+  if (round_up(REALSIZE(size)) >= PAGESIZE)
   {
     page_header->free_headers.buffer32.first_block = NULL;
     page_header->free_headers.buffer64.first_block = NULL;
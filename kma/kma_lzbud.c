@@ -50,24 +50,279 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* The lazy buddy system (Lee and Barkley, as in SVR4) does not coalesce
+   a freed block right away. A block freed "locally" stays marked as in
+   use in the buddy bitmap and goes to the head of its class's free list,
+   ready for the next malloc of that size; only a block freed "globally"
+   is marked free and merged with its buddy. Which of the two a free does
+   depends on the slack of the class,
+
+     slack = N - 2L - G = A - L
+
+   with N the blocks of the class, A of them allocated, L locally and G
+   globally free. With slack 2 or more the free is local, with 1 it is
+   global, and with 0 it is global and also makes one locally free block
+   global. Slack never goes below 0, so once all blocks of a class are
+   free none of them is locally free, everything has been coalesced and
+   all pages have been returned.
+
+   Like kma_mck2, blocks carry no header: the size comes with kma_free,
+   and the buddy bitmap and the page of each page are kept out of line,
+   indexed by page_index(). */
+typedef struct freeblock_t {
+  struct freeblock_t* next;
+  struct freeblock_t* prev;
+} freeblockT;
+
+/* Blocks of one class. Locally free ones are kept at the head of the
+   list and globally free ones at the tail; the list is circular around
+   the head. */
+typedef struct freeclass_t {
+  freeblockT list;
+  int allocated;
+  int local;
+  int global;
+} freeclassT;
+
+// Smallest block: room for the two free list links.
+#define MINSHIFT 4
+
+// Classes 16, 32, ..., 8192; the last one is a whole page.
+#define NUMCLASSES 10
+#define PAGECLASS (NUMCLASSES - 1)
+
+#define CLASSSIZE(class) (1 << (MINSHIFT + (class)))
+
+/* One bit per block of every class, numbered like a heap: the whole page
+   is bit 1, its halves bits 2 and 3, and so on down to bit 1023. */
+#define MAPBITS (1 << NUMCLASSES)
+#define MAPWORDS (MAPBITS / 64)
+
+typedef struct buddymap_t {
+  kma_page_t* page;
+  unsigned long long global[MAPWORDS]; // globally free blocks
+} buddymapT;
+
+#define SLACK(class) (classes[class].allocated - classes[class].local)
+
 /************Global Variables*********************************************/
 
+static buddymapT buddymaps[MAXPAGES];
+
+static freeclassT classes[NUMCLASSES];
+
 /************Function Prototypes******************************************/
 
+static void init_classes();
+static int size_class(kma_size_t);
+static int map_bit(void*, int);
+static void push_head(freeblockT*, int);
+static void push_tail(freeblockT*, int);
+static void unlink_block(freeblockT*);
+static void free_global(void*, int);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+/* Takes the first free block of the smallest class that has one, a
+   locally free block if there is any, and splits it down to the class of
+   the request. The upper halves are globally free buddies. A new page is
+   the block of last resort. */
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  buddymapT* map;
+  freeblockT* block;
+  int class, found;
+
+  if (size <= 0 || size > PAGESIZE)
+    return NULL;
+  if (classes[0].list.next == NULL)
+    init_classes();
+
+  class = size_class(size);
+  for (found = class; found < NUMCLASSES; found++)
+    if (classes[found].list.next != &classes[found].list)
+      break;
+
+  if (found == NUMCLASSES)
+    {
+      kma_page_t* page = get_page();
+
+      buddymaps[page_index(page->ptr)].page = page;
+      block = page->ptr;
+      found = PAGECLASS;
+    }
+  else
+    {
+      int bit;
+
+      block = classes[found].list.next;
+      unlink_block(block);
+      map = &buddymaps[page_index(block)];
+      bit = map_bit(block, found);
+      if (map->global[bit / 64] & (1ULL << (bit % 64)))
+        {
+          map->global[bit / 64] &= ~(1ULL << (bit % 64));
+          classes[found].global--;
+        }
+      else
+        classes[found].local--;
+    }
+
+  map = &buddymaps[page_index(block)];
+  while (found > class)
+    {
+      freeblockT* buddy;
+      int bit;
+
+      found--;
+      buddy = (freeblockT*) ((char*) block + CLASSSIZE(found));
+      bit = map_bit(buddy, found);
+      map->global[bit / 64] |= 1ULL << (bit % 64);
+      push_tail(buddy, found);
+      classes[found].global++;
+    }
+
+  classes[class].allocated++;
+  return block;
 }
 
+/* Frees the block locally while the class has slack to spare, and
+   globally (coalescing it) when it has not. With no slack at all a
+   locally free block of the class is coalesced as well. */
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  int class = size_class(size);
+  int slack = SLACK(class);
+
+  classes[class].allocated--;
+  if (slack >= 2)
+    {
+      push_head(ptr, class);
+      classes[class].local++;
+      return;
+    }
+
+  free_global(ptr, class);
+  if (slack == 0)
+    {
+      // locally free blocks are at the head of the list
+      freeblockT* block = classes[class].list.next;
+
+      assert(classes[class].local > 0);
+      unlink_block(block);
+      classes[class].local--;
+      free_global(block, class);
+    }
+}
+
+/* Makes every free list an empty circle. */
+static void
+init_classes()
+{
+  int class;
+
+  for (class = 0; class < NUMCLASSES; class++)
+    {
+      classes[class].list.next = &classes[class].list;
+      classes[class].list.prev = &classes[class].list;
+    }
+}
+
+/* Smallest class whose blocks hold size bytes. */
+static int
+size_class(kma_size_t size)
+{
+  int class = 0;
+
+  while (class < PAGECLASS && CLASSSIZE(class) < size)
+    class++;
+  return class;
+}
+
+/* The bit of a block of a class in its page's bitmap. */
+static int
+map_bit(void* block, int class)
+{
+  int offset = (char*) block - (char*) BASEADDR(block);
+
+  return (1 << (PAGECLASS - class)) + (offset >> (MINSHIFT + class));
+}
+
+/* Puts a block at the head of its class's free list. */
+static void
+push_head(freeblockT* block, int class)
+{
+  freeblockT* list = &classes[class].list;
+
+  block->prev = list;
+  block->next = list->next;
+  list->next->prev = block;
+  list->next = block;
+}
+
+/* Puts a block at the tail of its class's free list. */
+static void
+push_tail(freeblockT* block, int class)
+{
+  freeblockT* list = &classes[class].list;
+
+  block->next = list;
+  block->prev = list->prev;
+  list->prev->next = block;
+  list->prev = block;
+}
+
+/* Takes a block off whatever free list it is on. */
+static void
+unlink_block(freeblockT* block)
+{
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+}
+
+/* Marks a block globally free, merging it with its buddy for as long as
+   the buddy is globally free too. A whole page that ends up free goes
+   back to the page allocator. */
+static void
+free_global(void* ptr, int class)
+{
+  buddymapT* map = &buddymaps[page_index(ptr)];
+  char* block = ptr;
+  int bit;
+
+  while (class < PAGECLASS)
+    {
+      int offset = block - (char*) BASEADDR(block);
+      char* buddy = (char*) BASEADDR(block) + (offset ^ CLASSSIZE(class));
+
+      bit = map_bit(buddy, class);
+
+      if (!(map->global[bit / 64] & (1ULL << (bit % 64))))
+        break;
+
+      map->global[bit / 64] &= ~(1ULL << (bit % 64));
+      unlink_block((freeblockT*) buddy);
+      classes[class].global--;
+      if (buddy < block)
+        block = buddy;
+      class++;
+    }
+
+  if (class == PAGECLASS)
+    {
+      free_page(map->page);
+      map->page = NULL;
+      return;
+    }
+
+  bit = map_bit(block, class);
+  map->global[bit / 64] |= 1ULL << (bit % 64);
+  push_tail((freeblockT*) block, class);
+  classes[class].global++;
 }
 
 #endif // KMA_LZBUD
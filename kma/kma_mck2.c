@@ -50,24 +50,203 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* McKusick-Karels keeps the size of a block out of line: every page is
+   split into blocks of one power of two size, and the size class of the
+   page is recorded in kmemsizes, indexed by page_index(). Blocks carry no
+   header at all, so a 32 byte request takes exactly 32 bytes. A free
+   block links to its neighbors on its class's free list through its first
+   two words. A request bigger than the largest class gets a run of whole
+   pages: the entry of its first page counts the pages and the entries of
+   the others say they continue a run. */
+typedef struct freeblock_t {
+  struct freeblock_t* next;
+  struct freeblock_t* prev;
+} freeblockT;
+
+/* Out of line information about one page. */
+typedef struct kmemsize_t {
+  kma_page_t* page;
+  short class;    // size class of the blocks on the page
+  short free;     // how many of them are free
+  int pages;      // PAGECLASS: pages in the run
+} kmemsizeT;
+
+// Smallest block: room for the two free list links.
+#define MINSIZE 16
+
+// Classes 16, 32, ..., 4096, and runs of whole pages for anything
+// bigger.
+#define NUMCLASSES 10
+#define PAGECLASS (NUMCLASSES - 1)
+
+// Class of the pages of a run after the first.
+#define CONTCLASS (-1)
+
+// Block size of a class and blocks per page.
+#define CLASSSIZE(class) (MINSIZE << (class))
+#define CLASSBLOCKS(class) (PAGESIZE / CLASSSIZE(class))
+
 /************Global Variables*********************************************/
 
+static kmemsizeT kmemsizes[MAXPAGES];
+
+/* Free blocks of each class, from all pages. */
+static freeblockT* freelist[NUMCLASSES];
+
 /************Function Prototypes******************************************/
 
+static int size_class(kma_size_t);
+static void init_page(int);
+static void* init_run(kma_size_t);
+static void release_page(kmemsizeT*);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+/* Pops a block off the free list of the size class, carving up a new
+   page for the class when the list is empty. Requests bigger than half a
+   page get a run of pages of their own. */
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  freeblockT* block;
+  int class;
+
+  if (size <= 0)
+    return NULL;
+
+  class = size_class(size);
+  if (class == PAGECLASS)
+    return init_run(size);
+
+  if (freelist[class] == NULL)
+    init_page(class);
+
+  block = freelist[class];
+  freelist[class] = block->next;
+  if (block->next != NULL)
+    block->next->prev = NULL;
+  kmemsizes[page_index(block)].free--;
+
+  return block;
 }
 
+/* Looks the class up in kmemsizes and pushes the block on its free
+   list. The page goes back to the page allocator once all of its blocks
+   are free. */
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  kmemsizeT* usage = &kmemsizes[page_index(ptr)];
+  freeblockT* block = (freeblockT*) ptr;
+
+  assert(usage->class != CONTCLASS);
+  if (usage->class == PAGECLASS)
+    {
+      assert(usage->pages * PAGESIZE >= size);
+      free_pages(usage->page);
+      return;
+    }
+
+  block->prev = NULL;
+  block->next = freelist[usage->class];
+  if (block->next != NULL)
+    block->next->prev = block;
+  freelist[usage->class] = block;
+
+  usage->free++;
+  if (usage->free == CLASSBLOCKS(usage->class))
+    release_page(usage);
+}
+
+/* Smallest class whose blocks hold size bytes. */
+static int
+size_class(kma_size_t size)
+{
+  int class = 0;
+
+  while (class < PAGECLASS && CLASSSIZE(class) < size)
+    class++;
+  return class;
+}
+
+/* Gets a page for a class and puts all of its blocks on the class's
+   free list, lowest address first. */
+static void
+init_page(int class)
+{
+  kma_page_t* page = get_page();
+  kmemsizeT* usage = &kmemsizes[page_index(page->ptr)];
+  int block_size = CLASSSIZE(class);
+  int i;
+
+  usage->page = page;
+  usage->class = class;
+  usage->free = CLASSBLOCKS(class);
+
+  for (i = CLASSBLOCKS(class) - 1; i >= 0; i--)
+    {
+      freeblockT* block = (freeblockT*) ((char*) page->ptr + i * block_size);
+
+      block->prev = NULL;
+      block->next = freelist[class];
+      if (block->next != NULL)
+        block->next->prev = block;
+      freelist[class] = block;
+    }
+}
+
+/* Gets a run of pages for size bytes and tags it in kmemsizes. Returns
+   NULL if the pool could never hold it. */
+static void*
+init_run(kma_size_t size)
+{
+  int pages = (size + PAGESIZE - 1) / PAGESIZE;
+  kma_page_t* page;
+  kmemsizeT* usage;
+  int i;
+
+  if (size > MAXPAGES * PAGESIZE)
+    return NULL;
+
+  page = get_pages(pages, 1);
+  usage = &kmemsizes[page_index(page->ptr)];
+  usage->page = page;
+  usage->class = PAGECLASS;
+  usage->free = 0;
+  usage->pages = pages;
+  for (i = 1; i < pages; i++)
+    {
+      usage[i].page = NULL;
+      usage[i].class = CONTCLASS;
+    }
+  return page->ptr;
+}
+
+/* Takes the blocks of a page that is all free off their free list and
+   frees the page. Each of them was freed once to get here, so this costs
+   a constant per free. */
+static void
+release_page(kmemsizeT* usage)
+{
+  int block_size = CLASSSIZE(usage->class);
+  int i;
+
+  for (i = 0; i < CLASSBLOCKS(usage->class); i++)
+    {
+      freeblockT* block = (freeblockT*) ((char*) usage->page->ptr + i * block_size);
+
+      if (block->prev != NULL)
+        block->prev->next = block->next;
+      else
+        freelist[usage->class] = block->next;
+      if (block->next != NULL)
+        block->next->prev = block->prev;
+    }
+
+  free_page(usage->page);
+  usage->page = NULL;
 }
 
 #endif // KMA_MCK2
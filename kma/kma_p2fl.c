@@ -50,24 +50,203 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* Every page holds blocks of a single power of two size. The page header
+   sits at the start of the page, so kma_free() finds the size class of a
+   block from BASEADDR(ptr) and blocks themselves carry no header. A free
+   block keeps the pointer to the next free block of its page in its first
+   word. A request too big for PAGECLASS gets a run of pages of its own,
+   with the same header in its first page. */
+typedef struct pageheader_t {
+  kma_page_t* page;
+  void* free_blocks;          // first free block on this page
+  struct pageheader_t* next;  // other pages of this class with free blocks
+  struct pageheader_t* prev;
+  int class;
+  int used;                   // blocks handed out
+} pageheaderT;
+
+// Smallest block; large enough for the free list link and aligned for
+// any type.
+#define MINSIZE 16
+
+// Classes 16, 32, ..., 2048, and one block filling the rest of a page for
+// anything bigger (a 4096 byte block would also take a page of its own).
+#define NUMCLASSES 9
+#define PAGECLASS (NUMCLASSES - 1)
+
+// Class of a run of pages holding a single block. Runs are on no list.
+#define RUNCLASS NUMCLASSES
+
+// Space taken by the page header, rounded up to keep blocks aligned.
+#define HEADERSIZE ((sizeof(pageheaderT) + MINSIZE - 1) & ~(MINSIZE - 1))
+
+// Block size of a class.
+#define CLASSSIZE(class) \
+  ((class) == PAGECLASS ? (int) (PAGESIZE - HEADERSIZE) : MINSIZE << (class))
+
 /************Global Variables*********************************************/
 
+/* Per class list of the pages that have a free block. Full pages are on
+   no list until a block of theirs is freed. */
+static pageheaderT* partial_pages[NUMCLASSES];
+
 /************Function Prototypes******************************************/
 
+static int size_class(kma_size_t);
+static pageheaderT* init_page(int);
+static void* init_run(kma_size_t);
+static void link_page(pageheaderT*);
+static void unlink_page(pageheaderT*);
+
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+/* Takes the first free block of the first page of the size class with
+   one, getting a new page for the class if none has. Anything bigger
+   than a page class block gets a run. */
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+  pageheaderT* header;
+  void* block;
+  int class;
+
+  if (size <= 0)
+    return NULL;
+  if (size > CLASSSIZE(PAGECLASS))
+    return init_run(size);
+
+  class = size_class(size);
+  header = partial_pages[class];
+  if (header == NULL)
+    header = init_page(class);
+
+  block = header->free_blocks;
+  header->free_blocks = *((void**) block);
+  header->used++;
+
+  // page is full now
+  if (header->free_blocks == NULL)
+    unlink_page(header);
+
+  return block;
 }
 
+/* Puts the block back on its page's free list. A page that was full is
+   linked back into its class; a page with nothing left on it goes back
+   to the page allocator. */
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+  pageheaderT* header = (pageheaderT*) BASEADDR(ptr);
+
+  assert(header->used > 0);
+
+  if (header->class == RUNCLASS)
+    {
+      free_pages(header->page);
+      return;
+    }
+
+  if (header->free_blocks == NULL)
+    link_page(header);
+
+  *((void**) ptr) = header->free_blocks;
+  header->free_blocks = ptr;
+  header->used--;
+
+  if (header->used == 0)
+    {
+      unlink_page(header);
+      free_page(header->page);
+    }
+}
+
+/* Smallest class whose blocks hold size bytes. */
+static int
+size_class(kma_size_t size)
+{
+  int class = 0;
+
+  while (class < PAGECLASS && (MINSIZE << class) < size)
+    class++;
+  return class;
+}
+
+/* Gets a page for a class and threads all of its blocks onto the page's
+   free list, lowest address first. */
+static pageheaderT*
+init_page(int class)
+{
+  kma_page_t* page = get_page();
+  pageheaderT* header = (pageheaderT*) page->ptr;
+  int block_size = CLASSSIZE(class);
+  int count = (PAGESIZE - HEADERSIZE) / block_size;
+  char* first = (char*) page->ptr + HEADERSIZE;
+  int i;
+
+  header->page = page;
+  header->class = class;
+  header->used = 0;
+  header->free_blocks = NULL;
+
+  for (i = count - 1; i >= 0; i--)
+    {
+      void* block = first + i * block_size;
+      *((void**) block) = header->free_blocks;
+      header->free_blocks = block;
+    }
+
+  link_page(header);
+  return header;
+}
+
+/* Gets a run of pages for a single block of size bytes, after the page
+   header. Returns NULL if the pool could never hold it. */
+static void*
+init_run(kma_size_t size)
+{
+  int pages = (size + HEADERSIZE + PAGESIZE - 1) / PAGESIZE;
+  kma_page_t* page;
+  pageheaderT* header;
+
+  if (size > MAXPAGES * PAGESIZE - HEADERSIZE)
+    return NULL;
+
+  page = get_pages(pages, 1);
+  header = (pageheaderT*) page->ptr;
+  header->page = page;
+  header->class = RUNCLASS;
+  header->used = 1;
+  header->free_blocks = NULL;
+  header->next = header->prev = NULL;
+  return (char*) page->ptr + HEADERSIZE;
+}
+
+/* Adds a page to the front of its class's list of pages with free
+   blocks. */
+static void
+link_page(pageheaderT* header)
+{
+  header->prev = NULL;
+  header->next = partial_pages[header->class];
+  if (header->next != NULL)
+    header->next->prev = header;
+  partial_pages[header->class] = header;
+}
+
+/* Takes a page off its class's list. */
+static void
+unlink_page(pageheaderT* header)
+{
+  if (header->prev != NULL)
+    header->prev->next = header->next;
+  else
+    partial_pages[header->class] = header->next;
+  if (header->next != NULL)
+    header->next->prev = header->prev;
+  header->next = header->prev = NULL;
 }
 
 #endif // KMA_P2FL
@@ -45,6 +45,7 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -58,15 +59,54 @@
  */
 
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0 };
 
+/* The pool is one reservation of address space for MAXPAGES pages,
+   which costs no memory until a page is touched. It grows into it a
+   chunk of CHUNKPAGES pages at a time, and a chunk whose pages are all
+   free goes back to the system (madvise) until it is used again. The
+   chunk that emptied last is kept as spare_chunk and only given back
+   when another one empties, so a program that frees and allocates
+   around a chunk boundary does not fault the same pages in over and
+   over. Page
+   numbers are offsets into the reservation, so finding a page's chunk
+   is a division. */
 static void* pool = NULL;
-static void* next_free_page = NULL;
+static void* reservation = NULL;
+static int pool_pages = 0; // pages the pool has grown to
+
+typedef struct
+{
+  int used; // pages of the chunk in use
+} kma_chunk_t;
+
+static kma_chunk_t chunks[MAXPAGES / CHUNKPAGES];
+static int spare_chunk = -1; // an empty chunk still resident, or -1
+
+/* The free pages of the pool are a buddy system over page numbers: a
+   free block of order k is 2^k pages starting at a multiple of 2^k. It
+   is all kept out of line, so free pages are never touched. For the
+   first page of a free block, run_order is its order (-1 for every other
+   page) and run_next/run_prev link it on the list of its order. The
+   orders with a free block are the bits of run_orders. */
+#define MAXORDER 16 // MAXPAGES == 1 << MAXORDER
+
+static int run_order[MAXPAGES];
+static int run_next[MAXPAGES];
+static int run_prev[MAXPAGES];
+static int run_first[MAXORDER + 1];
+static int run_orders;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
+void* allocPages(int, int);
+void freePages(void*, int);
 void initPages();
+static int growPages();
+static void usePages(int, int, int);
+static int orderOf(int);
+static void pushRun(int, int);
+static void unlinkRun(int);
+static void releaseRun(int, int);
 
 /************External Declaration*****************************************/
 
@@ -74,18 +114,28 @@ void initPages();
 
 kma_page_t*
 get_page()
+{
+  return get_pages(1, 1);
+}
+
+kma_page_t*
+get_pages(int n, int alignment)
 {
   static int id = 0;
   kma_page_t* res;
 
+  assert(n > 0 && n <= MAXPAGES);
+  assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  kma_page_stats.num_requested += n;
+  kma_page_stats.num_in_use += n;
+  if (kma_page_stats.num_in_use > kma_page_stats.max_in_use)
+    kma_page_stats.max_in_use = kma_page_stats.num_in_use;
   
   res = (kma_page_t*) malloc(sizeof(kma_page_t));
   res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  res->size = n * kma_page_stats.page_size;
+  res->ptr = allocPages(n, alignment);
   
   assert(res->ptr != NULL);
   
@@ -94,15 +144,21 @@ get_page()
 
 void
 free_page(kma_page_t* ptr)
+{
+  free_pages(ptr);
+}
+
+void
+free_pages(kma_page_t* ptr)
 {
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  assert(kma_page_stats.num_in_use >= ptr->size / PAGESIZE);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  kma_page_stats.num_freed += ptr->size / PAGESIZE;
+  kma_page_stats.num_in_use -= ptr->size / PAGESIZE;
   
-  freePage(ptr->ptr);
+  freePages(ptr->ptr, ptr->size / PAGESIZE);
   free(ptr);
 }
 
@@ -114,43 +170,66 @@ page_stats()
   return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
 }
 
+int
+page_index(void* ptr)
+{
+  assert(pool != NULL);
+  assert(ptr >= pool && ptr < pool + pool_pages * PAGESIZE);
+  
+  return (BASEADDR(ptr) - pool) / PAGESIZE;
+}
+
+/* Takes the smallest free block that holds n pages at the alignment,
+   splitting it down and giving back the pages past the first n. */
 void*
-allocPage()
+allocPages(int n, int alignment)
 {
-  void* res;
+  int order = orderOf(n > alignment ? n : alignment);
+  int found, first;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
-  
-  if (res == NULL)
+  while ((run_orders >> order) == 0)
     {
-      error("error: all pages already allocated", "");
+      if (!growPages())
+        error("error: no run of free pages left", "");
     }
   
-  next_free_page = *((void**)next_free_page);
+  found = order + ffs(run_orders >> order) - 1;
+  first = run_first[found];
+  unlinkRun(first);
   
-  assert(res != NULL);
+  while (found > order)
+    {
+      found--;
+      pushRun(first + (1 << found), found);
+    }
+  
+  if (n < (1 << order))
+    {
+      releaseRun(first + n, (1 << order) - n);
+    }
+  usePages(first, n, 1);
   
-  return res;
+  return pool + first * PAGESIZE;
 }
 
 void
-freePage(void* ptr)
+freePages(void* ptr, int n)
 {
   assert(ptr != NULL);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  usePages((ptr - pool) / PAGESIZE, n, 0);
+  releaseRun((ptr - pool) / PAGESIZE, n);
   
   if (kma_page_stats.num_in_use == 0)
     {
-      free(pool);
+      munmap(reservation, (MAXPAGES + 1) * PAGESIZE);
+      reservation = NULL;
       pool = NULL;
-      next_free_page = NULL;
     }
 }
 
@@ -159,23 +238,151 @@ initPages()
 {
   int i;
   
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  // one page more than needed, to align the pool to PAGESIZE
+  reservation = mmap(NULL, (MAXPAGES + 1) * PAGESIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reservation == MAP_FAILED)
+    {
+      reservation = NULL;
+      error("Error using mmap to reserve the page pool", "");
+    }
+  pool = (void*) (((long) reservation + PAGESIZE - 1) & ~(PAGESIZE - 1));
+  pool_pages = 0;
+  spare_chunk = -1;
+  
+  for (i = 0; i <= MAXORDER; i++)
+    {
+      run_first[i] = -1;
+    }
+  run_orders = 0;
+}
+
+/* Adds the next chunk of the reservation to the free pages. Returns 0
+   when the pool is as big as it gets. */
+static int
+growPages()
+{
+  int first = pool_pages;
+  int i;
+  
+  if (pool_pages == MAXPAGES)
+    {
+      return 0;
+    }
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  for (i = first; i < first + CHUNKPAGES; i++)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      run_order[i] = -1;
+    }
+  chunks[first / CHUNKPAGES].used = 0;
+  pool_pages += CHUNKPAGES;
+  releaseRun(first, CHUNKPAGES);
+  return 1;
+}
+
+/* Counts n pages from first in (1) or out of (0) use in their chunks.
+   A chunk left with none becomes the spare, and the spare before it
+   goes back to the system. */
+static void
+usePages(int first, int n, int use)
+{
+  while (n > 0)
+    {
+      int index = first / CHUNKPAGES;
+      kma_chunk_t* chunk = &chunks[index];
+      int count = CHUNKPAGES - first % CHUNKPAGES;
       
-      *((void**) ptr) = next;
+      if (count > n)
+        {
+          count = n;
+        }
+      chunk->used += use ? count : -count;
+      assert(chunk->used >= 0 && chunk->used <= CHUNKPAGES);
+      if (use && index == spare_chunk)
+        {
+          spare_chunk = -1;
+        }
+      else if (chunk->used == 0)
+        {
+          if (spare_chunk >= 0)
+            {
+              madvise(pool + spare_chunk * CHUNKPAGES * PAGESIZE,
+                      CHUNKPAGES * PAGESIZE, MADV_DONTNEED);
+            }
+          spare_chunk = index;
+        }
+      first += count;
+      n -= count;
     }
+}
+
+/* Smallest order with at least n pages. */
+static int
+orderOf(int n)
+{
+  return n == 1 ? 0 : 32 - __builtin_clz(n - 1);
+}
+
+/* Lists the free block of an order starting at page first. */
+static void
+pushRun(int first, int order)
+{
+  run_order[first] = order;
+  run_prev[first] = -1;
+  run_next[first] = run_first[order];
+  if (run_first[order] >= 0)
+    {
+      run_prev[run_first[order]] = first;
+    }
+  run_first[order] = first;
+  run_orders |= 1 << order;
+}
+
+/* Takes the free block starting at page first off its list. */
+static void
+unlinkRun(int first)
+{
+  int order = run_order[first];
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  if (run_prev[first] >= 0)
+    run_next[run_prev[first]] = run_next[first];
+  else
+    run_first[order] = run_next[first];
+  if (run_next[first] >= 0)
+    run_prev[run_next[first]] = run_prev[first];
+  if (run_first[order] < 0)
+    run_orders &= ~(1 << order);
+  run_order[first] = -1;
+}
+
+/* Frees n pages from page first: as the largest aligned blocks that
+   tile them, each merged with its buddy for as long as the buddy is
+   free. */
+static void
+releaseRun(int first, int n)
+{
+  while (n > 0)
+    {
+      int order = first == 0 ? MAXORDER : __builtin_ctz(first);
+      int block = first;
+      
+      while ((1 << order) > n)
+        {
+          order--;
+        }
+      first += 1 << order;
+      n -= 1 << order;
+      
+      // the pool ends at pool_pages: no buddy beyond it is free yet
+      while (order < MAXORDER && (block ^ (1 << order)) < pool_pages
+             && run_order[block ^ (1 << order)] == order)
+        {
+          unlinkRun(block ^ (1 << order));
+          block &= ~(1 << order);
+          order++;
+        }
+      pushRun(block, order);
+    }
 }
@@ -64,7 +64,11 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+/* The pool reserves address space for MAXPAGES pages, but only maps
+   in CHUNKPAGES of them at a time, as they are needed. */
+#define MAXPAGES 65536
+
+#define CHUNKPAGES 256
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -89,6 +93,7 @@ typedef struct
   int num_freed;
   int num_in_use;
   int page_size;
+  int max_in_use; // high-water mark of num_in_use
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -104,15 +109,36 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n contiguous pages, starting at a multiple of
+ *             alignment pages from the start of the pool, in O(log n)
+ *    Input: the number of pages, and the alignment in pages (a power
+ *           of two; 1 for none)
+ *    Output: the allocated run, with size n * PAGESIZE
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int, int);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
- *    Purpose: Releases a memory page
+ *    Purpose: Releases a memory page, or a run of them
  *    Input: the pointer to the memory page structure
  *    Output: none
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Releases a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run from get_pages (or a single page), merging
+ *             it with the free pages around it
+ *    Input: the pointer to the memory page structure
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -122,6 +148,18 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page index
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the index of the page holding an address, for
+ *             allocators that keep per page information out of line
+ *             (indices run from 0 to MAXPAGES - 1, and stay below the
+ *             number of pages the pool has grown to)
+ *    Input: an address inside an allocated page
+ *    Output: the index of that page
+ ***********************************************************************/
+EXTERN int page_index(void*);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
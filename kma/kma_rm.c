@@ -38,6 +38,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,250 +51,541 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-/* Structure indicating the beginning of a free block. On request, the 
-   address of the front of this struct is given to be allocated, so this
-   will be overwritten. */
+/* Boundary tag: the size of a block, header included, and whether it
+   and the block before it are free. Every block starts with one, and a
+   free block ends with a copy of it too, so the blocks on both sides of
+   a block are found by address arithmetic. */
+typedef struct boundarytag_t {
+  int size;
+  int tags;
+} boundarytagT;
+
+#define FREE_TAG 1
+#define PREV_FREE_TAG 2
+#define RUN_TAG 4 // the block has a run of pages to itself
+
+/* Placement policy, picked at build time with -DRM_POLICY=... */
+#define RM_SEGREGATED_FIT 0 // size bins, see below
+#define RM_FIRST_FIT 1      // first fit in one address-ordered list
+#define RM_NEXT_FIT 2       // the same, going on from the last fit
+#define RM_BEST_FIT 3       // smallest fit, most recently freed first
+#define RM_AO_BEST_FIT 4    // smallest fit, lowest address first
+
+#ifndef RM_POLICY
+#define RM_POLICY RM_SEGREGATED_FIT
+#endif
+
+#define RM_TREE (RM_POLICY == RM_BEST_FIT || RM_POLICY == RM_AO_BEST_FIT)
+
+/* Structure at the beginning of a free block, which is also in the
+   index of free blocks of the policy: a bin, the free list, or a tree
+   ordered by size. An allocated block only has the tag. */
  typedef struct blockheader_t {
-  short size;
-  void* next_block;
+  boundarytagT tag;
+#if RM_TREE
+  struct blockheader_t* left;  // smaller blocks
+  struct blockheader_t* right; // larger blocks
+  long order;                  // orders blocks of the same size
+#else
+  struct blockheader_t* next;
+  struct blockheader_t* prev;
+#endif
  } blockheaderT;
 
-#define REAL_PAGE_SIZE (8192 - sizeof(blockheaderT))
-#define FIRST_PAGE_BLOCK (*((blockheaderT**) first_page->ptr))
-
+/* Structure at the beginning of each page. live counts the bytes of its
+   allocated blocks, so the page is empty when it drops to 0. */
+typedef struct pageheader_t {
+  kma_page_t* page;
+  int live;
+} pageheaderT;
+
+// Blocks fill the page between its header and an end tag that looks
+// like an allocated block, so the last block has a neighbor too.
+#define REAL_PAGE_SIZE ((int) (PAGESIZE - sizeof(pageheaderT) - sizeof(boundarytagT)))
+#define PAGE_HEADER(ptr) ((pageheaderT*) BASEADDR(ptr))
+
+// Gets the tag at the end of a free block, and the blocks on either side.
+#define FOOTER(block) ((boundarytagT*) ((long int) (block) + (block)->tag.size) - 1)
+#define NEXT_BLOCK(block) ((blockheaderT*) ((long int) (block) + (block)->tag.size))
+#define PREV_BLOCK(block) ((blockheaderT*) ((long int) (block) - ((boundarytagT*) (block) - 1)->size))
+
+// Gets a block from the address given out for it, and back.
+#define BLOCK(ptr) ((blockheaderT*) ((long int) (ptr) - sizeof(boundarytagT)))
+#define PAYLOAD(block) ((void*) ((long int) (block) + sizeof(boundarytagT)))
+
+// A free block holds its header and footer; sizes keep blocks aligned.
+#define MIN_BLOCK ((int) (sizeof(blockheaderT) + sizeof(boundarytagT)))
+#define BLOCK_SIZE(size) ((size) + sizeof(boundarytagT) < MIN_BLOCK ? MIN_BLOCK \
+                          : ((size) + sizeof(boundarytagT) + 7) & ~7)
+
+/* Segregated fits: each power of two from 32 up is split into four bins,
+   so the blocks of a bin differ in size by at most a quarter. Bins with
+   a block are the bits of bin_mask. */
+#define BIN_SPLIT 2 // log2 of the bins per power of two
+#define MIN_BIN_SHIFT 5
+#define NUM_BINS ((13 - MIN_BIN_SHIFT) << BIN_SPLIT)
+
+/* Bins are kept roughly in address order, so that allocations gather in
+   the lower pages and the higher ones empty out and are released. Both
+   the ordering and the search for a fit look at no more than this many
+   blocks of a bin. */
+#define BIN_SCAN 16
 
 /************Global Variables*********************************************/
 
-kma_page_t* first_page = NULL;
+#if RM_POLICY == RM_SEGREGATED_FIT
+blockheaderT* bins[NUM_BINS];
+unsigned int bin_mask = 0;
+#elif RM_TREE
+blockheaderT* free_tree = NULL;
+long free_count = 0;
+#else
+// circular, with free_list itself as the end
+blockheaderT free_list = { { 0, 0 }, &free_list, &free_list };
+blockheaderT* rover = &free_list;
+#endif
 
 /************Function Prototypes******************************************/
 
-void* find_first_fit(short size);
-void* new_page(short size);
-void update_malloc_headers(short size, blockheaderT* current_block, blockheaderT* previous_block);
-void coalesce();
-void clear_empty_pages();
+void* find_fit(int size);
+void* take_block(blockheaderT* block, int size);
+void* new_run(int size);
+blockheaderT* new_page();
+void set_free(blockheaderT* block);
+
+blockheaderT* free_find(int size);
+void free_insert(blockheaderT* block);
+void free_remove(blockheaderT* block);
+void free_resize(blockheaderT* block, int size);
+
+#if RM_POLICY == RM_SEGREGATED_FIT
+int bin_index(int size);
+#elif RM_TREE
+int tree_less(blockheaderT* a, blockheaderT* b);
+blockheaderT* tree_merge(blockheaderT* a, blockheaderT* b);
+void tree_split(blockheaderT* tree, blockheaderT* key, blockheaderT** less, blockheaderT** rest);
+#endif
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
-/* Main malloc function. On call, searches through all free block headers to
-   find the first one that fits. */
+/* Main malloc function. Finds a fitting free block, or one on a new
+   page, and gives out its end. A block too big for a page gets a run of
+   pages instead. */
 void* kma_malloc(kma_size_t size)
 {
-  if (first_page == NULL)
-  {
-    first_page = get_page();
-    blockheaderT* first_block_header = (blockheaderT*) ((long int) first_page->ptr + sizeof(blockheaderT*));
-    first_block_header->size = REAL_PAGE_SIZE;
-    first_block_header->next_block = NULL;
-    FIRST_PAGE_BLOCK = first_block_header;
-  }
-
-  if (size > REAL_PAGE_SIZE)
+  if (size <= 0 || size > MAXPAGES * PAGESIZE)
   {
     return NULL;  
   }
-  
-  return find_first_fit(size); // may point to not first page!
+
+  if (BLOCK_SIZE(size) > REAL_PAGE_SIZE)
+    return new_run(BLOCK_SIZE(size));
+
+  return find_fit(BLOCK_SIZE(size));
 }
 
-/* Main freeing function. On call, inserts a new free block header 
-   of the given size into the appropriate space in memory. Since the
-   list of free blocks is ordered by address, free must search
-   to find the right gap. Afterward, coalesces any free blocks 
-   together and clears any empty pages. */
+/* Main freeing function. The tags say whether the blocks right before
+   and after are free, and the block merges with those that are, in
+   constant time. A page with no live bytes left is released. */
 void kma_free(void* ptr, kma_size_t size)
 { 
-  blockheaderT* current_free_block = FIRST_PAGE_BLOCK;
-  blockheaderT* previous_block = NULL;
+  blockheaderT* block = BLOCK(ptr);
+  blockheaderT* next_block = NEXT_BLOCK(block);
+  pageheaderT* page = PAGE_HEADER(block);
+
+  // the tag must describe a block that holds the size given
+  assert(!(block->tag.tags & FREE_TAG));
+  assert((int) BLOCK_SIZE(size) <= block->tag.size);
+  (void) size; // with NDEBUG
+  if (block->tag.tags & RUN_TAG)
+  {
+    free_pages(page->page);
+    return;
+  }
+  page->live -= block->tag.size;
 
-  while (current_free_block != NULL)
+  if (next_block->tag.tags & FREE_TAG)
   {
-    if ((long int) current_free_block > (long int) ptr)
-    {
-      blockheaderT* new_block = (blockheaderT*) ptr;
-      new_block->size = (short) size; 
-      new_block->next_block = (void*) current_free_block;
-
-      if (previous_block == NULL)
-        *((blockheaderT**) (first_page->ptr)) = new_block;
-      else
-        previous_block->next_block = (void*) new_block;
-      break;
-    }
-    else
+    free_remove(next_block);
+    block->tag.size += next_block->tag.size;
+  }
+
+  // the block before grows in place
+  if (block->tag.tags & PREV_FREE_TAG)
+  {
+    blockheaderT* previous_block = PREV_BLOCK(block);
+
+    if (page->live == 0)
     {
-      previous_block = current_free_block;
-      current_free_block = (blockheaderT*) current_free_block->next_block;
+      assert(previous_block->tag.size + block->tag.size == REAL_PAGE_SIZE);
+      free_remove(previous_block);
+      free_page(page->page);
+      return;
     }
+    free_resize(previous_block, previous_block->tag.size + block->tag.size);
+    set_free(previous_block);
+    return;
+  }
+
+  if (page->live == 0)
+  {
+    assert(block->tag.size == REAL_PAGE_SIZE);
+    free_page(page->page);
+    return;
   }
 
-  coalesce();
-  clear_empty_pages();
+  set_free(block);
+  free_insert(block);
 }
 
-/* Iterates through and returns the first fit, except in the case that this fit
-   leaves a gap smaller than the free header. Reduces the appropriate header by
-   the given amount of space. Allocates a new page if no openings are found. */
-void* find_first_fit(short size)
+/* Takes the block the policy finds, or a new page. */
+void* find_fit(int size)
 {
-  blockheaderT* current_free_block = FIRST_PAGE_BLOCK;
-  blockheaderT* previous_block = NULL;
+  blockheaderT* block = free_find(size);
 
-  while (current_free_block != NULL)
+  if (block == NULL)
   {
-    // skip this block if it results in a really small extra space
-    if (current_free_block->size - size < sizeof(blockheaderT))
-    {
-      previous_block = current_free_block;
-      current_free_block = (blockheaderT*) current_free_block->next_block;
-    }
-    // good, normal fit
-    else if ((size < current_free_block->size))
-    { 
-      update_malloc_headers(size, current_free_block, previous_block);
-      return (void*) current_free_block;
-    }
-    else
-    {
-      previous_block = current_free_block;
-      current_free_block = (blockheaderT*) current_free_block->next_block;
-    }
+    block = new_page();
+    free_insert(block);
   }
 
-  // no openings, new page
-  return new_page(size);
+  return take_block(block, size);
 }
 
-/* Creates a new page and inserts that page into the appropriate location. Since get_page
-   may return a previously freed page, this iteration is necessary to find the right gap
-   to inset the free block headers into. This newly created block header is reduce by the
-   amount of space requested when creating this new page. */
-void* new_page(short size)
+/* Allocates the end of a free block, or the whole block if what would be
+   left can't be a free block. */
+void* take_block(blockheaderT* block, int size)
+{
+  PAGE_HEADER(block)->live += size;
+
+  if (block->tag.size - size < MIN_BLOCK)
+  {
+    free_remove(block);
+    PAGE_HEADER(block)->live += block->tag.size - size;
+    block->tag.tags &= ~FREE_TAG;
+    NEXT_BLOCK(block)->tag.tags &= ~PREV_FREE_TAG;
+    return PAYLOAD(block);
+  }
+
+  free_resize(block, block->tag.size - size);
+  set_free(block);
+
+  block = NEXT_BLOCK(block);
+  block->tag.size = size;
+  block->tag.tags = PREV_FREE_TAG;
+  NEXT_BLOCK(block)->tag.tags &= ~PREV_FREE_TAG;
+  return PAYLOAD(block);
+}
+
+/* Gets a page with a single free block filling it, followed by the end
+   tag. The block isn't indexed yet. */
+blockheaderT* new_page()
 {
   kma_page_t* page = get_page();
-  *((kma_page_t**)page->ptr) = page;
+  pageheaderT* page_header = (pageheaderT*) page->ptr;
+  blockheaderT* block = (blockheaderT*) ((long int) page->ptr + sizeof(pageheaderT));
+  boundarytagT* end = (boundarytagT*) ((long int) page->ptr + PAGESIZE) - 1;
+
+  page_header->page = page;
+  page_header->live = 0;
+  end->size = 0;
+  end->tags = 0;
+  block->tag.size = REAL_PAGE_SIZE;
+  block->tag.tags = 0;
+  set_free(block);
+
+  return block;
+}
+
+/* Gets a run of pages holding a single block of size bytes after the
+   page header. The block is never free and has no neighbors. */
+void* new_run(int size)
+{
+  int pages = (sizeof(pageheaderT) + size + PAGESIZE - 1) / PAGESIZE;
+  kma_page_t* page;
+  pageheaderT* page_header;
+  blockheaderT* block;
+
+  if (pages > MAXPAGES)
+    return NULL;
+
+  page = get_pages(pages, 1);
+  page_header = (pageheaderT*) page->ptr;
+  block = (blockheaderT*) ((long int) page->ptr + sizeof(pageheaderT));
+  page_header->page = page;
+  page_header->live = size;
+  block->tag.size = size;
+  block->tag.tags = RUN_TAG;
+
+  return PAYLOAD(block);
+}
+
+/* Marks a block free in its tags and footer, and in the tags of the
+   block after it. */
+void set_free(blockheaderT* block)
+{
+  block->tag.tags |= FREE_TAG;
+  *FOOTER(block) = block->tag;
+  NEXT_BLOCK(block)->tag.tags |= PREV_FREE_TAG;
+}
+
+#if RM_POLICY == RM_SEGREGATED_FIT
+
+/* Looks for a fit among the first blocks of the bin of the size, then
+   takes the first block of the first non-empty bin whose blocks all fit.
+   Returns NULL if no bin has one. */
+blockheaderT* free_find(int size)
+{
+  blockheaderT* block = bins[bin_index(size)];
+  int bin, scanned;
+
+  for (scanned = 0; block != NULL && scanned < BIN_SCAN; scanned++)
+  {
+    if (block->tag.size >= size)
+      return block;
+    block = block->next;
+  }
+
+  // round up to the next bin, so any block there is large enough
+  bin = bin_index(size + (1 << (31 - __builtin_clz(size) - BIN_SPLIT)) - 1);
+  if (bin < NUM_BINS && (bin_mask >> bin) != 0)
+    return bins[bin + ffs(bin_mask >> bin) - 1];
+
+  return NULL;
+}
 
-  blockheaderT* first_block_header = (blockheaderT*) ((long int) page->ptr + sizeof(void*) + size);
-  first_block_header->size = REAL_PAGE_SIZE-size;
-  first_block_header->next_block = NULL;
+/* Gets the bin of a size: its power of two, and which quarter of it. */
+int bin_index(int size)
+{
+  int shift = 31 - __builtin_clz(size);
+
+  return ((shift - MIN_BIN_SHIFT) << BIN_SPLIT)
+    + ((size >> (shift - BIN_SPLIT)) & ((1 << BIN_SPLIT) - 1));
+}
 
-  // find and insert block header in right spot
-  blockheaderT* current_free_block = FIRST_PAGE_BLOCK;
+/* Puts a free block in its bin, after the blocks at lower addresses
+   among the first BIN_SCAN. */
+void free_insert(blockheaderT* block)
+{
+  int bin = bin_index(block->tag.size);
   blockheaderT* previous_block = NULL;
+  blockheaderT* next_block = bins[bin];
+  int scanned;
 
-  while (current_free_block != NULL)
+  for (scanned = 0; next_block != NULL && scanned < BIN_SCAN &&
+    (long int) next_block < (long int) block; scanned++)
   {
-    if ((long int) current_free_block > (long int) first_block_header)
+    previous_block = next_block;
+    next_block = next_block->next;
+  }
+
+  block->prev = previous_block;
+  block->next = next_block;
+  if (next_block != NULL)
+    next_block->prev = block;
+  if (previous_block != NULL)
+    previous_block->next = block;
+  else
+    bins[bin] = block;
+  bin_mask |= 1U << bin;
+}
+
+/* Takes a free block out of its bin. */
+void free_remove(blockheaderT* block)
+{
+  int bin = bin_index(block->tag.size);
+
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    bins[bin] = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+  if (bins[bin] == NULL)
+    bin_mask &= ~(1U << bin);
+}
+
+/* Changes the size of a free block, moving it to its new bin. */
+void free_resize(blockheaderT* block, int size)
+{
+  free_remove(block);
+  block->tag.size = size;
+  free_insert(block);
+}
+
+#elif !RM_TREE
+
+/* Walks the free list, in address order, for the first block that
+   fits: from the start for first fit, and from where the last walk
+   stopped for next fit. Returns NULL if none does. */
+blockheaderT* free_find(int size)
+{
+#if RM_POLICY == RM_NEXT_FIT
+  blockheaderT* start = rover;
+#else
+  blockheaderT* start = &free_list;
+#endif
+  blockheaderT* block = start;
+
+  do
+  {
+    if (block != &free_list && block->tag.size >= size)
     {
-      previous_block->next_block = (void*) first_block_header;
-      first_block_header->next_block = (void*) current_free_block;
-      break;
+      rover = block;
+      return block;
     }
-    else if (current_free_block->next_block == NULL)
+    block = block->next;
+  } while (block != start);
+
+  return NULL;
+}
+
+/* Puts a free block in the free list, in address order. */
+void free_insert(blockheaderT* block)
+{
+  blockheaderT* next_block = free_list.next;
+
+  while (next_block != &free_list && (long int) next_block < (long int) block)
+    next_block = next_block->next;
+
+  block->next = next_block;
+  block->prev = next_block->prev;
+  next_block->prev->next = block;
+  next_block->prev = block;
+}
+
+/* Takes a free block out of the free list. */
+void free_remove(blockheaderT* block)
+{
+  if (rover == block)
+    rover = block->next;
+  block->prev->next = block->next;
+  block->next->prev = block->prev;
+}
+
+/* Changes the size of a free block, which keeps its place. */
+void free_resize(blockheaderT* block, int size)
+{
+  block->tag.size = size;
+}
+
+#else
+
+/* The free blocks are a treap: a binary search tree by size, then by
+   order, which is the address for address-ordered best fit and the
+   reverse of the order of the frees for best fit. It is kept balanced
+   (expected) by ordering blocks as a heap on a hash of their address. */
+#define PRIORITY(block) (((unsigned long) (block) >> 3) * 0x9E3779B97F4A7C15UL)
+
+/* Finds the smallest block that fits, first by order. Returns NULL if
+   none does. */
+blockheaderT* free_find(int size)
+{
+  blockheaderT* tree = free_tree;
+  blockheaderT* best = NULL;
+
+  while (tree != NULL)
+  {
+    if (tree->tag.size >= size)
     {
-      current_free_block->next_block = (void*) first_block_header;
-      break;
+      best = tree;
+      tree = tree->left;
     }
     else
-    {
-      previous_block = current_free_block;
-      current_free_block = (blockheaderT*) current_free_block->next_block;
-    }
+      tree = tree->right;
   }
 
-  return (void*)((long int) page->ptr + sizeof(void*));
+  return best;
+}
+
+/* Puts a free block in the tree. */
+void free_insert(blockheaderT* block)
+{
+  blockheaderT* less;
+  blockheaderT* rest;
+
+#if RM_POLICY == RM_AO_BEST_FIT
+  block->order = (long int) block;
+#else
+  block->order = -(++free_count);
+#endif
+  block->left = NULL;
+  block->right = NULL;
+  tree_split(free_tree, block, &less, &rest);
+  free_tree = tree_merge(tree_merge(less, block), rest);
 }
 
-/* Reduces a block header's size by giving up the front of the block and creating a new
-   block header after the allocated space. */
-void update_malloc_headers(short size, blockheaderT* current_block, blockheaderT* previous_block)
+/* Takes a free block out of the tree. */
+void free_remove(blockheaderT* block)
 {
-  blockheaderT* new_next = (blockheaderT*) current_block->next_block;
-  short new_size = current_block->size - size;
-  
-  blockheaderT* new_block;
-  new_block = (blockheaderT*) ((long int) current_block + size);
+  blockheaderT** link = &free_tree;
 
-  new_block->size = new_size;
-  new_block->next_block = (void*) new_next;
+  while (*link != block)
+    link = tree_less(block, *link) ? &(*link)->left : &(*link)->right;
+  *link = tree_merge(block->left, block->right);
+}
 
-  if (previous_block == NULL)
-    *((blockheaderT**) (first_page->ptr)) = new_block;
-  else
-    previous_block->next_block = (void*) new_block;
+/* Changes the size of a free block, moving it in the tree. It keeps its
+   order among blocks of the same size. */
+void free_resize(blockheaderT* block, int size)
+{
+  blockheaderT* less;
+  blockheaderT* rest;
+
+  free_remove(block);
+  block->tag.size = size;
+  block->left = NULL;
+  block->right = NULL;
+  tree_split(free_tree, block, &less, &rest);
+  free_tree = tree_merge(tree_merge(less, block), rest);
+}
+
+/* Whether block a comes before block b in the tree. */
+int tree_less(blockheaderT* a, blockheaderT* b)
+{
+  return a->tag.size < b->tag.size ||
+    (a->tag.size == b->tag.size && a->order < b->order);
 }
 
-/* Merges adjacent blocks on the same page if they are both free. Iterates through the entire list of
-   block headers looking for these. */
-void coalesce()
+/* Joins two trees, all of a before all of b. */
+blockheaderT* tree_merge(blockheaderT* a, blockheaderT* b)
 {
-  blockheaderT* current_block = FIRST_PAGE_BLOCK;
-  while (current_block != NULL)
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (PRIORITY(a) > PRIORITY(b))
   {
-    if (current_block->next_block != NULL &&
-      BASEADDR(current_block) == BASEADDR(current_block->next_block) &&
-      (((long int) current_block->next_block) - ((long int) current_block + (long int) current_block->size)) == 0)
-    {
-      current_block->size += ((blockheaderT*) (current_block->next_block))->size;
-      current_block->next_block = (void*) ((blockheaderT*) (current_block->next_block))->next_block;
-    }
-    else
-    {
-      current_block = (blockheaderT*) current_block->next_block;
-    }    
+    a->right = tree_merge(a->right, b);
+    return a;
   }
+  b->left = tree_merge(a, b->left);
+  return b;
 }
 
-/* Iterates through the set of all pages checking for any empty pages. Relinks the block headers as needed
-   to maintain the flow of the pages. */
-void clear_empty_pages()
+/* Splits a tree into the blocks before key and the rest. */
+void tree_split(blockheaderT* tree, blockheaderT* key, blockheaderT** less, blockheaderT** rest)
 {
-  blockheaderT* current_block = FIRST_PAGE_BLOCK;
-  blockheaderT* previous = NULL;
-  while (current_block != NULL)
+  if (tree == NULL)
   {
-    if (current_block->size == REAL_PAGE_SIZE)
-    {
-      void* current_page = BASEADDR(current_block);
-
-      // Not the first page, and in the middle of the list
-      if (current_page != (first_page->ptr) && previous != NULL)
-      {
-        previous->next_block = current_block->next_block;
-        free_page(*((kma_page_t**) current_page));
-      }
-      // Not the first page, but the first free block
-      else if (current_page != (first_page->ptr) && previous == NULL)
-      {
-        FIRST_PAGE_BLOCK = (blockheaderT*) current_block->next_block;
-        free_page(*((kma_page_t**) current_page));
-      }
-      // Is the first page
-      else
-      {
-        // More unfreed pages still exist
-        if (current_block->next_block != NULL)
-        {
-          kma_page_t* temp = first_page;
-          first_page = *((kma_page_t**) BASEADDR(current_block->next_block));
-          FIRST_PAGE_BLOCK = (blockheaderT*) current_block->next_block;
-          free_page(temp);
-        }
-        // First page is the only one left
-        else
-        {
-          free_page(first_page);
-          first_page = NULL;
-          return;
-        }
-      }
-    }
-    previous = current_block;
-    current_block = (blockheaderT*) current_block->next_block;
+    *less = NULL;
+    *rest = NULL;
+  }
+  else if (tree_less(tree, key))
+  {
+    *less = tree;
+    tree_split(tree->right, key, &tree->right, rest);
+  }
+  else
+  {
+    *rest = tree;
+    tree_split(tree->left, key, less, &tree->left);
   }
 }
 
+#endif // RM_POLICY
+
 #endif // KMA_RM
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Placement policy matrix for kma_rm: builds the competition binary once
+# per policy (RM_POLICY in kma_rm.c) and runs it over every trace,
+# reporting the average waste ratio, the page high water mark and the
+# time per request or free (best of RUNS runs, start-up included, so
+# the short traces mostly time that).
+#
+# usage: rm_policies.sh [traces...]   (or make bench-rm)
+
+cd `dirname $0` || exit 1;
+source config.test;
+
+POLICIES="RM_SEGREGATED_FIT RM_FIRST_FIT RM_NEXT_FIT RM_BEST_FIT RM_AO_BEST_FIT";
+TRACES=${@:-${TRACES}};
+RUNS=3;
+TMP=`mktemp -d /tmp/rm_policies.XXXXXX`;
+
+FILES="";
+for src in ${SRCS}; do
+	FILES="$FILES ../${src}";
+done;
+
+printf "%-18s %-8s %10s %8s %10s\n" policy trace ratio pages ns/op;
+
+for p in ${POLICIES}; do
+	if ! ${CC} -Wall -O2 -DCOMPETITION -DKMA_RM -DRM_POLICY=${p} \
+		-o ${TMP}/${p} ${FILES}; then
+		rm -Rf ${TMP};
+		exit 1;
+	fi;
+
+	for t in ${TRACES}; do
+		# every line after the count is a request or a free
+		OPS=$(( `wc -l < ${t}` - 1 ));
+		BEST=-1;
+		for i in `seq ${RUNS}`; do
+			START=`date +%s%N`;
+			${TMP}/${p} ${t} > ${TMP}/out 2>&1;
+			TIME=$(( `date +%s%N` - START ));
+			if [[ ${BEST} -lt 0 || ${TIME} -lt ${BEST} ]]; then
+				BEST=${TIME};
+			fi;
+		done;
+
+		if ! grep -q "Test: PASS" ${TMP}/out; then
+			printf "%-18s %-8s %10s\n" ${p} ${t} FAIL;
+			continue;
+		fi;
+		RATIO=`grep "Competition average ratio" ${TMP}/out | awk '{ print $4 }'`;
+		PAGES=`grep "Page high water mark" ${TMP}/out | awk '{ print $5 }'`;
+		printf "%-18s %-8s %10s %8s %10d\n" ${p} ${t} ${RATIO} ${PAGES} \
+			$(( BEST / OPS ));
+	done;
+done;
+
+rm -Rf ${TMP};
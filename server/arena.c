@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "stats.h"
+
+/*
+                   REQUEST ARENA
+
+Each worker owns an arena that request-scoped memory (the parsed
+request, the resource name) comes from. Allocation bumps a pointer in
+the current chunk; when the worker is done with the request the arena
+is reset by moving the pointer back, so a request costs no malloc or
+free at all however many pieces it is built from.
+
+The first chunk stays with the worker for its whole life. A request
+that outgrows it gets further chunks from the heap, which are freed
+again by the reset; arena_overflows in the stats counts those.
+
+Arenas are per thread, found through a thread-specific key, so a
+worker the elastic pool retires takes its arena with it.
+
+*/
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void free_arena(void* arena)
+{
+    arena_destroy((arena_t*) arena);
+}
+
+static void make_key()
+{
+    pthread_key_create(&arena_key, free_arena);
+}
+
+static arena_chunk_t* new_chunk(size_t size)
+{
+    arena_chunk_t* chunk = (arena_chunk_t*) malloc(sizeof(arena_chunk_t) + size);
+
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+arena_t* worker_arena()
+{
+    arena_t* arena;
+
+    pthread_once(&arena_once, make_key);
+    arena = (arena_t*) pthread_getspecific(arena_key);
+    if (arena != NULL)
+        return arena;
+
+    arena = (arena_t*) malloc(sizeof(arena_t));
+    if (arena == NULL)
+        return NULL;
+    arena->first = new_chunk(ARENA_CHUNK);
+    if (arena->first == NULL)
+    {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+    pthread_setspecific(arena_key, arena);
+    return arena;
+}
+
+void* arena_alloc(arena_t* arena, size_t size)
+{
+    arena_chunk_t* chunk = arena->current;
+    void* ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (chunk->size - chunk->used < size)
+    {
+        chunk = new_chunk(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+        if (chunk == NULL)
+            return NULL;
+        STATS_INC(arena_overflows);
+        arena->current->next = chunk;
+        arena->current = chunk;
+    }
+
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void arena_reset(arena_t* arena)
+{
+    arena_chunk_t* chunk;
+
+    if (arena == NULL)
+        return;
+    chunk = arena->first->next;
+    while (chunk != NULL)
+    {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+void arena_destroy(arena_t* arena)
+{
+    arena_reset(arena);
+    free(arena->first);
+    free(arena);
+}
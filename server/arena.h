@@ -0,0 +1,38 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_CHUNK 16384 // first chunk; enough for any request we parse
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk_t
+{
+    struct arena_chunk_t* next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk_t;
+
+// Bump allocator for memory that lives as long as one request.
+// Nothing is freed on its own; arena_reset() drops everything at once.
+typedef struct arena_t
+{
+    arena_chunk_t* first;   // kept across resets
+    arena_chunk_t* current; // chunk being bumped
+} arena_t;
+
+// The calling worker's arena, created on first use and freed when the
+// thread exits.
+arena_t* worker_arena();
+
+// Returns size bytes aligned to ARENA_ALIGN, or NULL if out of memory.
+void* arena_alloc(arena_t* arena, size_t size);
+
+// Frees everything allocated since the last reset. Chunks beyond the
+// first go back to the heap. Harmless on NULL.
+void arena_reset(arena_t* arena);
+
+void arena_destroy(arena_t* arena);
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include <limits.h>
+
+#include "request.h"
+
+/*
+                   PARSER BENCHMARK
+
+Parses and routes a fixed set of requests in a loop on one thread and
+reports requests per second, i.e. per core. Before that it checks how
+query values parse, and exits with 1 if one is off. The old handle_connection
+parsing (copy the request line into instr/file/type, scan the query
+once per argument, route with a chain of strncmp calls) is kept here
+as a baseline.
+
+usage: ./bench_parser [seconds]
+
+*/
+
+#define DEFAULT_SECONDS 2
+
+static const char* samples[] =
+{
+    "GET /list_seats HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept-Encoding: identity\r\n\r\n",
+
+    "GET /view_seat?user=9&seat=18 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept-Encoding: identity\r\n\r\n",
+
+    "GET /confirm?user=9&seat=18&priority=2 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+    "Accept: text/html,application/xhtml+xml\r\n"
+    "Connection: keep-alive\r\n\r\n",
+
+    "GET /cancel?user=7?seat=8 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept-Encoding: identity\r\n\r\n",
+
+    "GET /selectSeats.html?user=1 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Accept-Encoding: identity\r\n\r\n",
+};
+
+#define NUM_SAMPLES ((int) (sizeof(samples) / sizeof(samples[0])))
+
+static const char* const route_names[] =
+{
+    "list_seats",
+    "view_seat",
+    "confirm",
+    "cancel"
+};
+
+static route_table_t routes;
+static volatile int sink;
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int new_parse(const char* buf, int len)
+{
+    http_request_t request;
+    slice_t path;
+
+    if (http_header_end(buf, len, 0) == 0)
+        return -1;
+    if (http_parse_request(buf, len, &request) != 0)
+        return -1;
+
+    path = request.path;
+    path.ptr++;
+    path.len--;
+
+    return route_lookup(&routes, path)
+        + request_int_param(&request, "seat")
+        + request_int_param(&request, "user")
+        + request_int_param(&request, "priority");
+}
+
+// parse_int_arg() as it was in util.c
+static int legacy_int_arg(char* filename, char* arg)
+{
+    int i;
+    bool found_value_start = false;
+    bool found_arg_list_start = false;
+    int seatnum = 0;
+    for(i=0; i < strlen(filename); i++)
+    {
+        if (!found_arg_list_start)
+        {
+            if (filename[i] == '?')
+                found_arg_list_start = true;
+            continue;
+        }
+        if (!found_value_start && strncmp(&filename[i], arg, strlen(arg)) == 0)
+        {
+            found_value_start = true;
+            i += strlen(arg);
+        }
+        if (found_value_start)
+        {
+            if(isdigit(filename[i]))
+            {
+                seatnum = seatnum * 10 + (int) filename[i] - (int) '0';
+                continue;
+            }
+            else
+                break;
+        }
+    }
+    return seatnum;
+}
+
+// The request line handling from the old handle_connection. The old
+// server read headers a byte at a time; only the scan is counted here.
+static int legacy_parse(const char* buf, int len)
+{
+    char instr[20];
+    char file[100];
+    char type[20];
+    int i = 0, j = 0, length, route;
+
+    while (!isspace(buf[j]) && (i < sizeof(instr) - 1))
+    {
+        instr[i] = buf[i];
+        i++;
+        j++;
+    }
+    j += 2;
+    instr[i] = '\0';
+    if (strncmp(instr, "GET", 3) != 0)
+        return -1;
+
+    i = 0;
+    while (!isspace(buf[j]) && (i < sizeof(file) - 1))
+        file[i++] = buf[j++];
+    j++;
+    file[i] = '\0';
+
+    i = 0;
+    while (!isspace(buf[j]) && (buf[j] != '\0') && (i < sizeof(type) - 1))
+        type[i++] = buf[j++];
+    type[i] = '\0';
+
+    // skip the headers
+    for (i = j; i < len && strncmp(buf + i, "\r\n\r\n", 4) != 0; i++)
+        ;
+
+    for (i = 0; i < strlen(file); i++)
+    {
+        if (file[i] == '?')
+            break;
+    }
+    length = i;
+    char resource[length+1];
+    strncpy(resource, file, length);
+    resource[length] = 0;
+
+    int seat_id = legacy_int_arg(file, "seat=");
+    int user_id = legacy_int_arg(file, "user=");
+    int priority = legacy_int_arg(file, "priority=");
+
+    if (strncmp(resource, "list_seats", length) == 0)
+        route = 0;
+    else if (strncmp(resource, "view_seat", length) == 0)
+        route = 1;
+    else if (strncmp(resource, "confirm", length) == 0)
+        route = 2;
+    else if (strncmp(resource, "cancel", length) == 0)
+        route = 3;
+    else
+        route = -1;
+
+    return route + seat_id + user_id + priority;
+}
+
+// Query values and what request_int_param should make of them.
+static const struct
+{
+    const char* query;
+    int seat;
+} param_cases[] =
+{
+    { "seat=18", 18 },
+    { "seat=", 0 },
+    { "user=1", 0 },
+    { "seat=abc", 0 },
+    { "seat=-5", 0 },
+    { "seat=12ab", 12 },
+    { "seat=2147483647", INT_MAX },
+    { "seat=2147483648", INT_MAX },
+    { "seat=4294967296", INT_MAX },
+    { "seat=99999999999999999999", INT_MAX },
+};
+
+// Returns the number of cases that parse wrong.
+static int check_params()
+{
+    char buf[256];
+    http_request_t request;
+    int i, len, seat, failed = 0;
+
+    for (i = 0; i < (int) (sizeof(param_cases) / sizeof(param_cases[0])); i++)
+    {
+        len = snprintf(buf, sizeof(buf), "GET /view_seat?%s HTTP/1.1\r\n\r\n",
+                       param_cases[i].query);
+        if (http_parse_request(buf, len, &request) != 0)
+            seat = -1;
+        else
+            seat = request_int_param(&request, "seat");
+        if (seat != param_cases[i].seat)
+        {
+            fprintf(stderr, "%s: got %d, expected %d\n",
+                    param_cases[i].query, seat, param_cases[i].seat);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static void run(const char* name, int (*parse)(const char*, int), double seconds)
+{
+    int lengths[NUM_SAMPLES];
+    long long count = 0;
+    double start, elapsed;
+    int i;
+
+    for (i = 0; i < NUM_SAMPLES; i++)
+        lengths[i] = strlen(samples[i]);
+
+    start = now_sec();
+    do
+    {
+        // check the clock every 64k requests
+        for (i = 0; i < 65536; i++)
+        {
+            int k = i % NUM_SAMPLES;
+            sink += parse(samples[k], lengths[k]);
+        }
+        count += 65536;
+        elapsed = now_sec() - start;
+    } while (elapsed < seconds);
+
+    printf("%-8s %12.0f requests/sec/core  %7.1f ns/request\n",
+           name, count / elapsed, elapsed * 1e9 / count);
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = DEFAULT_SECONDS;
+
+    if (argc > 1)
+        seconds = atof(argv[1]);
+
+    if (route_table_build(&routes, route_names, 4) != 0)
+    {
+        fprintf(stderr, "Unable to build route table\n");
+        return 1;
+    }
+
+    if (check_params() != 0)
+        return 1;
+
+    run("legacy", legacy_parse, seconds);
+    run("parser", new_parse, seconds);
+    return 0;
+}
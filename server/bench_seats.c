@@ -0,0 +1,518 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+
+#include "request.h"
+#include "seats.h"
+#include "lockprof.h"
+
+/*
+                   SEAT BENCHMARK
+
+Replays a request stream straight into seats.c, without the server and
+without sockets, so the booking logic can be measured apart from the
+network stack. Each request is a GET line that goes through
+http_parse_request() and the route table like in serve_request(), and
+then calls list_seats, view_seat, confirm_seat or cancel. Each thread
+replays its own stream.
+
+The stream is synthetic by default. A thread plays one user at a time.
+The user views a seat, and once the view holds it, confirms or cancels
+it. Confirms and cancels that come when no seat is held go to a random
+seat and usually fail, as stray requests do. Seats are drawn uniformly,
+or from a Zipf distribution with -z (a few hot seats). Users are drawn
+uniformly from -u users. With -f the paths of a testsuite trace are
+replayed instead, each thread cycling through them; paths that aren't
+seat operations (the html pages) are skipped.
+
+Nothing in the API frees a confirmed seat, so a venue sells out and
+every later view fails. With -r the threads stop after every so many
+operations each and the venue is loaded again, empty. The reload is not
+counted in the time.
+
+seats.c logs every confirm and cancel to stdout. That output goes to
+/dev/null unless -v is given, and the report goes to stderr.
+
+usage: ./bench_seats [-t threads] [-n ops per thread] [-s seats]
+                     [-u users] [-m view,confirm,cancel,list]
+                     [-z zipf exponent] [-r ops per round]
+                     [-f tracefile] [-v]
+
+*/
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPS 200000
+#define DEFAULT_SEATS 1000
+#define TRACE_SEATS 20       // the server's default, which the traces assume
+#define DEFAULT_USERS 1000
+#define DEFAULT_ROUND 1000
+#define MAX_PATHS 64
+#define PATH_SIZE 256
+#define REQUEST_SIZE 512
+#define RESPONSE_SIZE 8192
+
+typedef enum
+{
+    OP_VIEW,
+    OP_CONFIRM,
+    OP_CANCEL,
+    OP_LIST,
+    NUM_OPS
+} op_t;
+
+static const char* const route_names[NUM_OPS] =
+{
+    "view_seat",
+    "confirm",
+    "cancel",
+    "list_seats"
+};
+
+// what a successful response starts with
+static const char* const ok_prefix[NUM_OPS] =
+{
+    "Confirm seat:",
+    "Seat confirmed:",
+    "Seat request cancelled:",
+    ""
+};
+
+typedef struct
+{
+    double* latencies; // us
+    int count;
+    int ok;
+} op_stats_t;
+
+typedef struct
+{
+    int id;
+    unsigned long long rng;
+    op_stats_t ops[NUM_OPS];
+} worker_t;
+
+static route_table_t routes;
+static int threads = DEFAULT_THREADS;
+static int ops_per_thread = DEFAULT_OPS;
+static int num_seats = DEFAULT_SEATS;
+static int num_users = DEFAULT_USERS;
+static int round_ops = DEFAULT_ROUND; // 0: the venue is never reloaded
+static int mix[NUM_OPS] = { 60, 20, 15, 5 };
+static int mix_total;
+static double skew = 0;
+static double* seat_cdf; // Zipf, when skew > 0
+
+static char paths[MAX_PATHS][PATH_SIZE];
+static int num_paths;
+
+static pthread_barrier_t round_barrier;
+static double reload_time; // us
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// xorshift64*
+static unsigned long long next_random(worker_t* w)
+{
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+static double uniform(worker_t* w)
+{
+    return (next_random(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int pick_seat(worker_t* w)
+{
+    double u;
+    int lo = 0, hi = num_seats - 1;
+
+    if (seat_cdf == NULL)
+        return next_random(w) % num_seats;
+
+    u = uniform(w);
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (seat_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static op_t pick_op(worker_t* w)
+{
+    int r = next_random(w) % mix_total;
+    int op;
+
+    for (op = 0; op < NUM_OPS - 1; op++)
+    {
+        if (r < mix[op])
+            break;
+        r -= mix[op];
+    }
+    return (op_t) op;
+}
+
+// Parses and routes one request and runs the operation, as
+// serve_request() does. Returns the route, or -1 if it isn't a seat
+// operation.
+static int serve(const char* req, int len, char* buf)
+{
+    http_request_t request;
+    slice_t path;
+    int route, seat_id, user_id, priority;
+
+    if (http_parse_request(req, len, &request) != 0)
+        return -1;
+    path = request.path;
+    if (path.len > 0 && path.ptr[0] == '/')
+    {
+        path.ptr++;
+        path.len--;
+    }
+
+    seat_id = request_int_param(&request, "seat");
+    user_id = request_int_param(&request, "user");
+    priority = request_int_param(&request, "priority");
+
+    buf[0] = '\0';
+    route = route_lookup(&routes, path);
+    switch (route)
+    {
+    case OP_VIEW:
+        view_seat(buf, RESPONSE_SIZE, seat_id, user_id, priority);
+        break;
+    case OP_CONFIRM:
+        confirm_seat(buf, RESPONSE_SIZE, seat_id, user_id, priority);
+        break;
+    case OP_CANCEL:
+        cancel(buf, RESPONSE_SIZE, seat_id, user_id, priority);
+        break;
+    case OP_LIST:
+        list_seats(buf, RESPONSE_SIZE);
+        break;
+    default:
+        return -1;
+    }
+    return route;
+}
+
+// Between rounds: every thread stops, one of them loads the venue again.
+static void end_round()
+{
+    if (pthread_barrier_wait(&round_barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        double start = now_us();
+        unload_seats();
+        load_seats(num_seats);
+        reload_time += now_us() - start;
+    }
+    pthread_barrier_wait(&round_barrier);
+}
+
+static void record(worker_t* w, int route, double start, const char* buf)
+{
+    op_stats_t* s;
+
+    if (route < 0)
+        return;
+    s = &w->ops[route];
+    s->latencies[s->count++] = now_us() - start;
+    if (strncmp(buf, ok_prefix[route], strlen(ok_prefix[route])) == 0)
+        s->ok++;
+}
+
+static void* run_synthetic(void* arg)
+{
+    worker_t* w = (worker_t*) arg;
+    char req[REQUEST_SIZE];
+    char buf[RESPONSE_SIZE];
+    int user = 1 + next_random(w) % num_users;
+    int held = -1; // seat the current user holds
+    int i;
+
+    for (i = 0; i < ops_per_thread; i++)
+    {
+        op_t op;
+        int seat, len, route;
+        double start;
+
+        if (round_ops > 0 && i > 0 && i % round_ops == 0)
+        {
+            end_round();
+            held = -1;
+        }
+        op = pick_op(w);
+        seat = held >= 0 && op != OP_LIST ? held : pick_seat(w);
+        if (op == OP_VIEW && held >= 0)
+            op = next_random(w) & 1 ? OP_CONFIRM : OP_CANCEL;
+
+        if (op == OP_LIST)
+            len = snprintf(req, sizeof(req), "GET /list_seats HTTP/1.1\r\n\r\n");
+        else
+            len = snprintf(req, sizeof(req), "GET /%s?user=%d&seat=%d HTTP/1.1\r\n\r\n",
+                           route_names[op], user, seat);
+
+        start = now_us();
+        route = serve(req, len, buf);
+        record(w, route, start, buf);
+
+        if (op == OP_VIEW && strncmp(buf, ok_prefix[OP_VIEW], strlen(ok_prefix[OP_VIEW])) == 0)
+            held = seat;
+        else if (op == OP_CONFIRM || op == OP_CANCEL)
+        {
+            // this user is done; the next one comes along
+            held = -1;
+            user = 1 + next_random(w) % num_users;
+        }
+    }
+    return NULL;
+}
+
+static void* run_trace(void* arg)
+{
+    worker_t* w = (worker_t*) arg;
+    char req[REQUEST_SIZE];
+    char buf[RESPONSE_SIZE];
+    int i;
+
+    for (i = 0; i < ops_per_thread; i++)
+    {
+        if (round_ops > 0 && i > 0 && i % round_ops == 0)
+            end_round();
+
+        int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\n\r\n", paths[i % num_paths]);
+        double start = now_us();
+        int route = serve(req, len, buf);
+        record(w, route, start, buf);
+    }
+    return NULL;
+}
+
+// Reads the paths of every [trace*] section, and threads and requests
+// from [configuration], the way loadgen does.
+static int parse_trace(const char* file, int* trace_threads, int* trace_requests)
+{
+    char line[PATH_SIZE];
+    int in_trace = 0;
+    FILE* f = fopen(file, "r");
+
+    if (f == NULL)
+    {
+        perror(file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '%')
+            continue;
+        if (line[0] == '[')
+        {
+            in_trace = strncmp(line, "[trace", 6) == 0;
+            continue;
+        }
+        if (!in_trace)
+        {
+            sscanf(line, "threads=%d", trace_threads);
+            sscanf(line, "requests=%d", trace_requests);
+        }
+        else if (num_paths < MAX_PATHS)
+        {
+            line[strcspn(line, " ")] = '\0';
+            strcpy(paths[num_paths++], line);
+        }
+    }
+    fclose(f);
+    return num_paths > 0 ? 0 : -1;
+}
+
+static void build_zipf()
+{
+    double sum = 0;
+    int i;
+
+    seat_cdf = malloc(num_seats * sizeof(double));
+    for (i = 0; i < num_seats; i++)
+    {
+        sum += 1.0 / pow(i + 1, skew);
+        seat_cdf[i] = sum;
+    }
+    for (i = 0; i < num_seats; i++)
+        seat_cdf[i] /= sum;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-n ops per thread] [-s seats] [-u users]\n"
+                    "       [-m view,confirm,cancel,list] [-z zipf exponent] [-r ops per round]\n"
+                    "       [-f tracefile] [-v]\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* trace_file = NULL;
+    int verbose = 0, set_threads = 0, set_ops = 0, set_seats = 0;
+    int trace_threads = 1, trace_requests = 1;
+    pthread_t* tids;
+    worker_t* workers;
+    double start, elapsed;
+    long total = 0;
+    int opt, i, op, next, occupied = 0;
+    unsigned char* packed;
+    char report[8192];
+
+    while ((opt = getopt(argc, argv, "t:n:s:u:m:z:r:f:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': threads = atoi(optarg); set_threads = 1; break;
+        case 'n': ops_per_thread = atoi(optarg); set_ops = 1; break;
+        case 's': num_seats = atoi(optarg); set_seats = 1; break;
+        case 'u': num_users = atoi(optarg); break;
+        case 'z': skew = atof(optarg); break;
+        case 'r': round_ops = atoi(optarg); break;
+        case 'f': trace_file = optarg; break;
+        case 'v': verbose = 1; break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d,%d", &mix[OP_VIEW], &mix[OP_CONFIRM],
+                       &mix[OP_CANCEL], &mix[OP_LIST]) < 3)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    for (op = 0; op < NUM_OPS; op++)
+        mix_total += mix[op];
+    if (threads < 1 || ops_per_thread < 1 || num_seats < 1 || num_users < 1
+        || mix_total < 1 || round_ops < 0)
+        usage(argv[0]);
+
+    if (trace_file != NULL)
+    {
+        if (parse_trace(trace_file, &trace_threads, &trace_requests) != 0)
+            return 1;
+        if (!set_threads)
+            threads = trace_threads;
+        if (!set_ops)
+            ops_per_thread = trace_requests * num_paths;
+        if (!set_seats)
+            num_seats = TRACE_SEATS;
+    }
+    if (skew > 0)
+        build_zipf();
+
+    if (route_table_build(&routes, route_names, NUM_OPS) != 0)
+    {
+        fprintf(stderr, "Unable to build route table\n");
+        return 1;
+    }
+
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL)
+        perror("/dev/null");
+
+    load_seats(num_seats);
+    pthread_barrier_init(&round_barrier, NULL, threads);
+
+    tids = malloc(threads * sizeof(pthread_t));
+    workers = calloc(threads, sizeof(worker_t));
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].id = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        for (op = 0; op < NUM_OPS; op++)
+            workers[i].ops[op].latencies = malloc(ops_per_thread * sizeof(double));
+    }
+
+    start = now_us();
+    for (i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, trace_file ? run_trace : run_synthetic, &workers[i]);
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    elapsed = (now_us() - start - reload_time) / 1e6;
+
+    // count the occupied seats from the packed map, four to a byte
+    packed = malloc((num_seats + 3) / 4);
+    next = 0;
+    seat_map_pack(packed, (num_seats + 3) / 4, &next, num_seats);
+    for (i = 0; i < num_seats; i++)
+        occupied += ((packed[i / 4] >> (2 * (i % 4))) & 3) == OCCUPIED;
+    fflush(stdout);
+
+    if (trace_file != NULL)
+        fprintf(stderr, "trace %s: %d paths\n", trace_file, num_paths);
+    else
+        fprintf(stderr, "mix view %d confirm %d cancel %d list %d, %d users, zipf %.2f\n",
+                mix[OP_VIEW], mix[OP_CONFIRM], mix[OP_CANCEL], mix[OP_LIST], num_users, skew);
+    if (round_ops > 0)
+        fprintf(stderr, "venue reloaded every %d ops per thread\n", round_ops);
+
+    for (op = 0; op < NUM_OPS; op++)
+        for (i = 0; i < threads; i++)
+            total += workers[i].ops[op].count;
+    fprintf(stderr, "%d threads, %d seats: %ld ops in %.2f s, %.0f ops/sec\n",
+            threads, num_seats, total, elapsed, total / elapsed);
+    fprintf(stderr, "%-10s %10s %6s %9s %9s %9s %9s\n",
+            "op", "count", "ok%", "avg us", "p50 us", "p99 us", "max us");
+
+    for (op = 0; op < NUM_OPS; op++)
+    {
+        double* all;
+        double sum = 0;
+        int count = 0, ok = 0, j;
+
+        for (i = 0; i < threads; i++)
+        {
+            count += workers[i].ops[op].count;
+            ok += workers[i].ops[op].ok;
+        }
+        if (count == 0)
+            continue;
+
+        all = malloc(count * sizeof(double));
+        count = 0;
+        for (i = 0; i < threads; i++)
+        {
+            for (j = 0; j < workers[i].ops[op].count; j++)
+            {
+                all[count++] = workers[i].ops[op].latencies[j];
+                sum += workers[i].ops[op].latencies[j];
+            }
+        }
+        qsort(all, count, sizeof(double), compare_double);
+        fprintf(stderr, "%-10s %10d %6.1f %9.3f %9.3f %9.3f %9.3f\n",
+                route_names[op], count, 100.0 * ok / count, sum / count,
+                all[count / 2], all[(int) (count * 0.99)], all[count - 1]);
+        free(all);
+    }
+    fprintf(stderr, "seats occupied at the end: %d of %d\n", occupied, num_seats);
+
+    // built with LOCK_PROFILE=1: where the time went
+    if (lockprof_format(report, sizeof(report)) > 0)
+        fprintf(stderr, "%s", report);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include "request.h"
+#include "response.h"
+#include "timer_wheel.h"
+
+#define CONN_INBUF 4096
+#define CONN_WINDOW 8192
+#define FILENAMESIZE 100
+
+// Deadlines for slow or silent clients. The whole header block must
+// arrive within HEADER_TIMEOUT_MS of the first byte (or of accepting);
+// a kept-alive connection may sit without a request for IDLE_TIMEOUT_MS;
+// and a response that makes no progress for SEND_TIMEOUT_MS is dropped.
+#define HEADER_TIMEOUT_MS 10000
+#define IDLE_TIMEOUT_MS 15000
+#define SEND_TIMEOUT_MS 30000
+
+typedef enum
+{
+    CONN_IDLE,     // kept alive, waiting for the next request
+    CONN_READING,  // waiting for the rest of the request headers
+    CONN_WORKING,  // a worker is building the response
+    CONN_SENDING,  // response (or part of it) is being written
+    CONN_SUBSCRIBED, // change feed subscriber waiting for the next change
+    CONN_CLOSING
+} conn_state_t;
+
+// One client connection. In the event driven modes the reactor owns it
+// except while a worker has it (CONN_WORKING); in blocking mode it lives
+// on the worker's stack.
+//
+// The response's header goes out from response; bodies too large for a
+// single buffer are streamed through the out window, one window at a
+// time, from file_fd or from a produce function.
+typedef struct conn_t
+{
+    int fd;
+    conn_state_t state;
+
+    char in[CONN_INBUF];
+    int in_len;
+    int header_len;
+    http_request_t* request; // parsed by serve_request into the worker's arena;
+                             // valid only until the worker is done with it
+    int keep_alive;         // set by the caller if allowed, cleared by serve_request if not asked for
+
+    response_t response;
+    char out[CONN_WINDOW];
+    int file_fd;            // -1 unless a file body is being streamed
+    long long file_offset;
+    long long file_left;
+
+    // Generated bodies: produce renders the next part into buf, at most
+    // size bytes, and advances stream_pos towards stream_end. NULL when
+    // there is nothing more to generate.
+    int (*produce)(struct conn_t* conn, char* buf, int size);
+    int stream_pos;
+    int stream_end;
+    unsigned long long stream_since; // binary seat map: only changes after this version;
+                                     // feed subscriber: last change sent
+
+    int subscriber;         // set by the caller if the connection may be held open as a
+                            // change feed subscriber, cleared by serve_request if it isn't one
+    struct feed_block_t* feed_block;      // shared events being sent (reactor only)
+    struct conn_t* feed_prev;             // idle subscriber list (reactor only)
+    struct conn_t* feed_next;
+    int chunked;            // generated body is sent with chunked encoding
+
+    wheel_timer_t timer;    // deadline for the current state
+
+    int pending;            // backend operation in flight
+    int io_flags;           // backend private
+    struct conn_t* io_next; // backend private list link
+    struct conn_t* next;    // free list / done list link
+} conn_t;
+
+#endif
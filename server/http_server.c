@@ -10,38 +10,227 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "thread_pool.h"
 #include "seats.h"
 #include "util.h"
+#include "reactor.h"
+#include "stats.h"
+#include "restart.h"
+#include "replica.h"
 
 #define BUFSIZE 1024
 #define FILENAMESIZE 100
 
 // our definitions
-#define MAX_THREADS 20
-#define QUEUE_SIZE 20
-
-void shutdown_server(int);
+#define MIN_THREADS 4
+#define MAX_THREADS 64
+// The queue bound is only a backstop: admission control turns work away
+// on queue delay (pool_overloaded) well before a burst fills it.
+#define QUEUE_SIZE 256
 
 int listenfd;
 pool_t* threadpool;
 
-int main(int argc,char *argv[])
+static io_mode_t mode = IO_BLOCKING;
+static int stop_pipe[2] = { -1, -1 }; // blocking mode: wakes the accept loop
+static int restart_channel = -1;      // set once a new server is ready
+static char exe_path[4096];
+static char** exe_argv;
+static int following; // a hot standby, not serving yet
+static int serving;
+
+// Opens the listening socket. Returns -1 with errno set on failure.
+static int open_listener(int port)
 {
-    int flag, num_seats = 20;
-    int connfd = 0;
     struct sockaddr_in serv_addr;
+    int fd, flag = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    // set server address 
+    memset(&serv_addr, '0', sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(port);
+
+    // bind to socket, and listen for incoming requests; a short backlog
+    // turns bursts of connects into 1s SYN retransmits
+    if (bind(fd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) != 0
+        || listen(fd, 128) != 0)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    printf("Established Socket: %d\n", fd);
+    return fd;
+}
+
+// Stops accepting and lets main() drain and exit, or hand over.
+static void stop_serving()
+{
+    char byte = 0;
+
+    if (mode == IO_BLOCKING)
+    {
+        if (write(stop_pipe[1], &byte, 1) < 0)
+            perror("stop");
+    }
+    else
+        reactor_stop();
+}
 
-    char send_buffer[BUFSIZE];
+// Blocking mode: accepts and hands each connection to a worker until
+// stopped, starting with the connections in held.
+static void serve_blocking(const int* held, int num_held)
+{
+    struct pollfd waiting[2];
+    int connfd, i;
+    char byte;
+
+    for (i = 0; i < num_held; i++)
+    {
+        STATS_INC(accepted);
+        if (pool_try_add_task(threadpool, (void *) (intptr_t) held[i]) != 0)
+        {
+            STATS_INC(shed_full);
+            shed_connection(held[i]);
+        }
+    }
+
+    // The listener may come nonblocking from an event driven server;
+    // either way poll() says when to accept.
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    waiting[0].fd = listenfd;
+    waiting[0].events = POLLIN;
+    waiting[1].fd = stop_pipe[0];
+    waiting[1].events = POLLIN;
+
+    // handle connections loop (until stopped)
+    while (1)
+    {
+        if (poll(waiting, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (waiting[1].revents)
+        {
+            // taken, so a later serve_blocking() waits for a new stop
+            if (read(stop_pipe[0], &byte, 1) < 0)
+                perror("stop");
+            break;
+        }
+        if (!waiting[0].revents)
+            continue;
+
+        connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
+        if (connfd < 0)
+            continue;
+        STATS_INC(accepted);
+
+        // Admission control: when requests are already waiting too long,
+        // taking more only makes every one of them slower.
+        if (pool_overloaded(threadpool))
+        {
+            STATS_INC(shed_overload);
+            shed_connection(connfd);
+            continue;
+        }
+
+        // Adds task to threadpool! The descriptor travels in the task
+        // pointer itself, so handing a connection over allocates nothing.
+        if (pool_try_add_task(threadpool, (void *) (intptr_t) connfd) != 0)
+        {
+            STATS_INC(shed_full);
+            shed_connection(connfd);
+        }
+    }
+}
+
+// Signals are blocked in every thread and taken here instead, where a
+// restart can fork, wait and log like any other code.
+static void* control_thread(void* arg)
+{
+    sigset_t* signals = arg;
+    int signo, channel;
+
+    while (sigwait(signals, &signo) == 0)
+    {
+        if (signo != SIGHUP && following)
+        {
+            printf("Stopped following\n");
+            exit(0);
+        }
+        if (signo != SIGHUP)
+        {
+            stop_serving();
+            continue;
+        }
+        if (!serving || restart_channel >= 0)
+            continue; // not started yet, or already handing over
+        printf("Restarting %s\n", exe_path);
+        channel = restart_spawn(exe_path, exe_argv);
+        if (channel < 0)
+            continue;
+        // the new server accepts from here on, while we drain
+        if (restart_send_listener(channel, listenfd) != 0)
+        {
+            close(channel);
+            continue;
+        }
+        restart_channel = channel;
+        stop_serving();
+    }
+    return NULL;
+}
+
+int main(int argc,char *argv[])
+{
+    int num_seats = 20;
+    int opt, handoff;
+    ssize_t len;
+    sigset_t signals;
+    pthread_t control;
+    char report[8192];
+    const char* replica_path = NULL;
+    const char* follow_path = NULL;
+    int held[RESTART_HOLD];
+    int num_held = 0;
     
     listenfd = 0; 
 
     int server_port = 8080;
 
-    if (argc > 1)
+    // -b picks how connections are driven: blocking (a worker per
+    // connection), epoll, uring, or auto (io_uring when available).
+    // -R streams the seat changes to a hot standby on a Unix socket, and
+    // -F makes this server that standby (see replica.c).
+    while ((opt = getopt(argc, argv, "b:R:F:")) != -1)
     {
-        num_seats = atoi(argv[1]);
+        if (opt == 'R')
+            replica_path = optarg;
+        else if (opt == 'F')
+            follow_path = optarg;
+        else if (opt != 'b' || (int) (mode = parse_io_mode(optarg)) < 0)
+        {
+            fprintf(stderr, "usage: %s [-b auto|blocking|epoll|uring] [-R socket] [-F socket] [num_seats]\n",
+                    argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (optind < argc)
+    {
+        num_seats = atoi(argv[optind]);
     } 
 
     if (server_port < 1500)
@@ -49,60 +238,140 @@ int main(int argc,char *argv[])
         fprintf(stderr,"INVALID PORT NUMBER: %d; can't be < 1500\n",server_port);
         exit(-1);
     }
-    
-    if (signal(SIGINT, shutdown_server) == SIG_ERR) 
-        printf("Issue registering SIGINT handler");
 
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if ( listenfd < 0 ){
-        perror("Socket");
+    // SIGHUP restarts with the binary now at our path, so remember it
+    // before anyone replaces it
+    len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len < 0)
+        len = snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
+    exe_path[len] = '\0';
+    exe_argv = argv;
+
+    // a client that hangs up early shows up as EPIPE, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    // Block the signals before any thread starts so that all of them
+    // inherit the mask and only the control thread sees them.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // Started by a restart: the old server still owns the listening
+    // socket and hands it over below.
+    handoff = restart_inherited();
+
+    if (mode == IO_BLOCKING && pipe(stop_pipe) != 0)
+    {
+        perror("pipe");
         exit(errno);
     }
-    printf("Established Socket: %d\n", listenfd);
-    flag = 1;
-    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) );
 
-    // Initialize the threadpool
-    // Set the number of threads and size of the queue
-    threadpool = pool_create(QUEUE_SIZE, MAX_THREADS, (void *) handle_connection);
+    // Build the route table and header blocks before any worker needs them
+    init_handlers();
 
-    // Load the seats;
-    load_seats(num_seats);
+    // Initialize the threadpool
+    // Set the size of the queue and the range of threads; the pool grows
+    // towards MAX_THREADS under load and shrinks back when it goes idle.
+    // In the event driven modes workers only build responses; the
+    // reactor thread does the socket I/O.
+    if (mode == IO_BLOCKING)
+        threadpool = pool_create_elastic(QUEUE_SIZE, MIN_THREADS, MAX_THREADS, handle_connection);
+    else
+        threadpool = pool_create_elastic(QUEUE_SIZE, MIN_THREADS, MAX_THREADS, reactor_work);
 
-    // set server address 
-    memset(&serv_addr, '0', sizeof(serv_addr));
-    memset(send_buffer, '0', sizeof(send_buffer));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(server_port);
+    if (pthread_create(&control, NULL, control_thread, &signals) != 0)
+    {
+        perror("control thread");
+        exit(-1);
+    }
 
-    // bind to socket
-    if ( bind(listenfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) != 0)
+    if (handoff >= 0)
     {
-        perror("socket--bind");
-        exit(errno);
+        // Ready: the old server sends the socket, drains, then sends
+        // the seats; what we accept meanwhile waits in held
+        listenfd = restart_takeover(handoff, held, &num_held);
+        if (listenfd < 0)
+        {
+            fprintf(stderr, "restart: takeover failed\n");
+            exit(-1);
+        }
+        printf("Took over socket: %d\n", listenfd);
+    }
+    else if (follow_path != NULL)
+    {
+        // Hot standby: mirror the primary's seats until it is gone, then
+        // take over its port. While the port is still taken the primary
+        // is serving (or restarting), so follow it again.
+        following = 1;
+        printf("Following %s\n", follow_path);
+        fflush(stdout);
+        while (1)
+        {
+            replica_follow(follow_path);
+            if ((listenfd = open_listener(server_port)) >= 0)
+                break;
+            if (errno != EADDRINUSE)
+            {
+                perror("socket--bind");
+                exit(errno);
+            }
+            usleep(100 * 1000);
+        }
+        following = 0;
+        printf("Took over at version %llu\n", seats_version());
     }
+    else
+    {
+        // Load the seats;
+        load_seats(num_seats);
 
-    // listen for incoming requests
-    listen(listenfd, 10);
+        listenfd = open_listener(server_port);
+        if (listenfd < 0)
+        {
+            perror("socket--bind");
+            exit(errno);
+        }
+    }
 
-    // handle connections loop (forever)
-    while(1)
+    while (1)
     {
-        connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
+        if (replica_path != NULL && replica_serve(replica_path) != 0)
+            fprintf(stderr, "replica: not replicating\n");
+        fflush(stdout);
+        serving = 1;
 
-        // Allocate a new variable. connfd would be used by all connections, so
-        // we do this to prevent weird behavior as it's passed in but overwritten.
-        // This is all freed in util.c later on.
-        int* conn = malloc(sizeof(int));
-        *conn = connfd;
+        if (mode != IO_BLOCKING)
+        {
+            reactor_adopt(held, num_held);
+            if (reactor_run(listenfd, mode, threadpool) != 0)
+                exit(-1);
+        }
+        else
+            serve_blocking(held, num_held);
+        num_held = 0;
 
-        // Adds task to threadpool!
-        pool_add_task(threadpool, (void *) conn);        
+        // Nothing new comes in now; let what did finish.
+        pool_drain(threadpool);
+        replica_stop();
+
+        if (restart_channel < 0)
+            break;
+        if (restart_handoff(restart_channel, held, &num_held) == 0)
+        {
+            printf("Handed over to the new server\n");
+            break;
+        }
+        // The new server gave up without serving a request, so our seats
+        // are still the seats: go on serving, with what it held.
+        printf("Restart failed, serving again\n");
+        restart_channel = -1;
     }
-}
 
-void shutdown_server(int signo){
+    stats_format(report, sizeof(report));
+    printf("%s", report);
+    fflush(stdout);
     pool_destroy(threadpool);
     unload_seats();
     close(listenfd);
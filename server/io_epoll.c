@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "reactor.h"
+
+/*
+                   EPOLL BACKEND
+
+Readiness based backend. Sockets are registered edge triggered for
+both directions once; each operation is first tried right away and
+only waits for an event if it would block. Operations that finish
+immediately are not completed inline but put on a ready list that the
+wait loop drains, so a response that streams many windows does not
+recurse through the callbacks.
+
+*/
+
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64
+
+#define OP_NONE 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_READ_FILE 3
+#define OP_CLOSE 4
+
+#define FLAG_REGISTERED 1
+#define FLAG_QUEUED 2
+#define FLAG_ABORT 4
+
+static int epfd = -1;
+static int listen_fd = -1;
+static int wake_fd = -1;
+
+// tags for the two fds that are not connections
+static char listen_tag;
+static char wake_tag;
+
+static conn_t* ready_head = NULL;
+static conn_t* ready_tail = NULL;
+
+static void make_ready(conn_t* conn, int op);
+static void try_op(conn_t* conn);
+static void accept_all();
+
+static int epoll_init(int listenfd, int wakefd)
+{
+    struct epoll_event ev;
+
+    if (epfd >= 0)
+        close(epfd); // from an earlier reactor_run()
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+    listen_fd = listenfd;
+    wake_fd = wakefd;
+
+    // the listener is level triggered; accept_all() takes a batch at a time
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) != 0)
+    {
+        perror("epoll_ctl listen");
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) != 0)
+    {
+        perror("epoll_ctl eventfd");
+        return -1;
+    }
+    return 0;
+}
+
+static void epoll_recv(conn_t* conn)
+{
+    if (!(conn->io_flags & FLAG_REGISTERED))
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) == 0)
+            conn->io_flags |= FLAG_REGISTERED;
+    }
+    make_ready(conn, OP_RECV);
+}
+
+static void epoll_send(conn_t* conn)
+{
+    make_ready(conn, OP_SEND);
+}
+
+static void epoll_read_file(conn_t* conn)
+{
+    make_ready(conn, OP_READ_FILE);
+}
+
+static void epoll_close(conn_t* conn)
+{
+    make_ready(conn, OP_CLOSE);
+}
+
+// The pending operation is failed from the ready list rather than here,
+// so the callback doesn't run inside the reactor's timer processing.
+static void epoll_abort(conn_t* conn)
+{
+    if (conn->pending == OP_NONE || conn->pending == OP_CLOSE)
+        return;
+    conn->io_flags |= FLAG_ABORT;
+    make_ready(conn, conn->pending);
+}
+
+static void epoll_stop_accept()
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+    reactor_on_accept_stopped();
+}
+
+static int epoll_wait_events(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n, i, count;
+
+    if (ready_head != NULL)
+        timeout_ms = 0;
+
+    n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR)
+    {
+        perror("epoll_wait");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        void* tag = events[i].data.ptr;
+
+        if (tag == &listen_tag)
+            accept_all();
+        else if (tag == &wake_tag)
+        {
+            uint64_t value;
+            if (read(wake_fd, &value, sizeof(value)) > 0)
+                reactor_on_wake();
+        }
+        else
+        {
+            conn_t* conn = (conn_t*) tag;
+            uint32_t e = events[i].events;
+
+            // only the operation the connection is waiting on matters
+            if ((conn->pending == OP_RECV && (e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+                || (conn->pending == OP_SEND && (e & (EPOLLOUT | EPOLLERR | EPOLLHUP))))
+                make_ready(conn, conn->pending);
+        }
+    }
+
+    // Run what is ready now. Operations started by the callbacks wait
+    // for the next pass so one busy connection can't starve the rest.
+    for (count = 0, i = 0; i < MAX_EVENTS && ready_head != NULL; i++)
+    {
+        conn_t* conn = ready_head;
+        ready_head = conn->io_next;
+        if (ready_head == NULL)
+            ready_tail = NULL;
+        conn->io_flags &= ~FLAG_QUEUED;
+        try_op(conn);
+        count++;
+    }
+    return count;
+}
+
+// Queues conn to have op tried on the next pass of the wait loop.
+static void make_ready(conn_t* conn, int op)
+{
+    conn->pending = op;
+    if (conn->io_flags & FLAG_QUEUED)
+        return;
+    conn->io_flags |= FLAG_QUEUED;
+    conn->io_next = NULL;
+    if (ready_tail != NULL)
+        ready_tail->io_next = conn;
+    else
+        ready_head = conn;
+    ready_tail = conn;
+}
+
+static void try_op(conn_t* conn)
+{
+    ssize_t rc;
+
+    if ((conn->io_flags & FLAG_ABORT) && conn->pending != OP_CLOSE)
+    {
+        int op = conn->pending;
+
+        conn->io_flags &= ~FLAG_ABORT;
+        conn->pending = OP_NONE;
+        if (op == OP_RECV)
+            reactor_on_recv(conn, -1);
+        else if (op == OP_SEND)
+            reactor_on_sent(conn, -1);
+        else if (op == OP_READ_FILE)
+            reactor_on_file_read(conn, -1);
+        return;
+    }
+
+    switch (conn->pending)
+    {
+    case OP_RECV:
+        rc = read(conn->fd, conn->in + conn->in_len, CONN_INBUF - conn->in_len);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // wait for EPOLLIN
+        if (rc < 0 && errno == EINTR)
+        {
+            make_ready(conn, OP_RECV);
+            return;
+        }
+        conn->pending = OP_NONE;
+        reactor_on_recv(conn, rc);
+        break;
+
+    case OP_SEND:
+        rc = writev(conn->fd, conn->response.iov + conn->response.iovpos,
+                    conn->response.iovcnt - conn->response.iovpos);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // wait for EPOLLOUT
+        if (rc < 0 && errno == EINTR)
+        {
+            make_ready(conn, OP_SEND);
+            return;
+        }
+        conn->pending = OP_NONE;
+        reactor_on_sent(conn, rc);
+        break;
+
+    case OP_READ_FILE:
+        rc = pread(conn->file_fd, conn->out,
+                   conn->file_left < CONN_WINDOW ? conn->file_left : CONN_WINDOW,
+                   conn->file_offset);
+        conn->pending = OP_NONE;
+        reactor_on_file_read(conn, rc);
+        break;
+
+    case OP_CLOSE:
+        // closing the socket also drops it from the epoll set
+        if (conn->file_fd != -1)
+            close(conn->file_fd);
+        conn->file_fd = -1;
+        close(conn->fd);
+        conn->pending = OP_NONE;
+        conn->io_flags = 0;
+        reactor_on_closed(conn);
+        break;
+    }
+}
+
+static void accept_all()
+{
+    int i;
+
+    for (i = 0; i < ACCEPT_BATCH; i++)
+    {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+        reactor_on_accept(fd);
+    }
+}
+
+io_backend_t epoll_backend =
+{
+    "epoll",
+    epoll_init,
+    epoll_recv,
+    epoll_send,
+    epoll_read_file,
+    epoll_close,
+    epoll_abort,
+    epoll_stop_accept,
+    epoll_wait_events
+};
@@ -0,0 +1,515 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "reactor.h"
+
+/*
+                   IO_URING BACKEND
+
+Completion based backend talking to the kernel through the raw
+io_uring syscalls (no liburing). Operations are queued as submission
+entries and sent to the kernel in one io_uring_enter() per loop pass,
+which also waits for completions, so a pass that accepts, reads,
+sends and closes for many connections costs one syscall.
+
+Connections come from a single multishot accept. Request bytes are
+received into a provided buffer ring (the kernel picks a free buffer
+when data arrives, so idle connections don't pin a receive buffer) and
+copied into the connection. Responses go out with writev, file windows
+are read with IORING_OP_READ and sockets and files are closed with
+IORING_OP_CLOSE.
+
+Needs Linux 5.19 or newer (multishot accept, buffer rings). init fails
+on older kernels, or when built without HAVE_IO_URING, and the reactor
+uses epoll instead.
+
+*/
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES 1024
+#define RECV_BUFFERS 512     // power of two
+#define RECV_BUFSIZE 2048
+#define RECV_GROUP 0
+
+// The low bits of user_data say what completed; the rest is the conn.
+#define OP_MASK 7
+#define OP_ACCEPT 1
+#define OP_WAKE 2
+#define OP_RECV 3
+#define OP_SEND 4
+#define OP_READ_FILE 5
+#define OP_CLOSE 6
+#define OP_IGNORE 7
+
+static int ring_fd = -1;
+static int listen_fd = -1;
+static int accept_stopping;
+static int wake_fd = -1;
+static uint64_t wake_value;
+
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static struct io_uring_sqe* sqes;
+static unsigned sq_local_tail;
+static unsigned to_submit;
+
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+
+static struct io_uring_buf_ring* buf_ring;
+static char* recv_buffers;
+static unsigned short buf_tail;
+
+static void* ring_mem; // the mapped rings, kept to unmap them
+static size_t ring_mem_size;
+static size_t sqes_size;
+
+static int ring_enter(unsigned submit, unsigned min_complete, unsigned flags,
+                      void* arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, arg, argsz);
+}
+
+// Publishes queued entries to the kernel.
+static int ring_submit(unsigned min_complete, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int rc;
+
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+    if (min_complete > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        memset(&arg, 0, sizeof(arg));
+        if (timeout_ms >= 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+        rc = ring_enter(to_submit, min_complete, flags, &arg, sizeof(arg));
+    }
+    else
+        rc = ring_enter(to_submit, 0, 0, NULL, 0);
+
+    if (rc >= 0)
+        to_submit -= (unsigned) rc < to_submit ? (unsigned) rc : to_submit;
+    return rc;
+}
+
+static struct io_uring_sqe* get_sqe()
+{
+    struct io_uring_sqe* sqe;
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+    // full: hand what we have to the kernel first
+    while (sq_local_tail - head >= RING_ENTRIES)
+    {
+        if (ring_submit(0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            exit(-1);
+        }
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    sqe = &sqes[sq_local_tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[sq_local_tail & *sq_mask] = sq_local_tail & *sq_mask;
+    sq_local_tail++;
+    to_submit++;
+    return sqe;
+}
+
+static void set_data(struct io_uring_sqe* sqe, void* ptr, int op)
+{
+    sqe->user_data = (uint64_t) (uintptr_t) ptr | op;
+}
+
+static void arm_accept()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    set_data(sqe, NULL, OP_ACCEPT);
+}
+
+static void arm_wake()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &wake_value;
+    sqe->len = sizeof(wake_value);
+    set_data(sqe, NULL, OP_WAKE);
+}
+
+// Gives a receive buffer back to the kernel.
+static void recycle_buffer(unsigned short bid)
+{
+    struct io_uring_buf* buf = &buf_ring->bufs[buf_tail & (RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (recv_buffers + bid * RECV_BUFSIZE);
+    buf->len = RECV_BUFSIZE;
+    buf->bid = bid;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_buffer_ring()
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+    int i;
+
+    buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buf_ring == MAP_FAILED)
+    {
+        buf_ring = NULL;
+        return -1;
+    }
+    recv_buffers = malloc(RECV_BUFFERS * RECV_BUFSIZE);
+    if (recv_buffers == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return -1;
+
+    buf_tail = 0;
+    for (i = 0; i < RECV_BUFFERS; i++)
+        recycle_buffer(i);
+    return 0;
+}
+
+// Tears down the ring of an earlier reactor_run().
+static void uring_release()
+{
+    munmap(sqes, sqes_size);
+    munmap(ring_mem, ring_mem_size);
+    munmap(buf_ring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+    free(recv_buffers);
+    ring_mem = NULL;
+    sqes = NULL;
+    buf_ring = NULL;
+    recv_buffers = NULL;
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+static int uring_init(int listenfd, int wakefd)
+{
+    struct io_uring_params params;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size, cq_size;
+
+    if (ring_fd >= 0)
+        uring_release();
+    accept_stopping = 0;
+    ring_mem = NULL;
+    sqes = NULL;
+    buf_ring = NULL;
+    recv_buffers = NULL;
+
+    // Only this thread touches the ring, so completion work can wait
+    // until we ask for events instead of interrupting us (6.1+).
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring_fd < 0 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    }
+    if (ring_fd < 0)
+        return -1;
+
+    // EXT_ARG (5.11) lets io_uring_enter wait with a timeout
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP))
+        goto fail;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+    cq_ptr = sq_ptr;
+    ring_mem = sq_ptr;
+    ring_mem_size = sq_size;
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail;
+
+    sq_head = (unsigned*) ((char*) sq_ptr + params.sq_off.head);
+    sq_tail = (unsigned*) ((char*) sq_ptr + params.sq_off.tail);
+    sq_mask = (unsigned*) ((char*) sq_ptr + params.sq_off.ring_mask);
+    sq_array = (unsigned*) ((char*) sq_ptr + params.sq_off.array);
+    cq_head = (unsigned*) ((char*) cq_ptr + params.cq_off.head);
+    cq_tail = (unsigned*) ((char*) cq_ptr + params.cq_off.tail);
+    cq_mask = (unsigned*) ((char*) cq_ptr + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) ((char*) cq_ptr + params.cq_off.cqes);
+    sq_local_tail = *sq_tail;
+    to_submit = 0;
+
+    // buffer rings arrived in 5.19, together with multishot accept
+    if (setup_buffer_ring() != 0)
+        goto fail;
+
+    listen_fd = listenfd;
+    wake_fd = wakefd;
+    arm_accept();
+    arm_wake();
+    if (ring_submit(0, 0) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    // undo whatever was set up
+    if (recv_buffers != NULL)
+        free(recv_buffers);
+    if (buf_ring != NULL)
+        munmap(buf_ring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+    if (sqes != NULL && sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (ring_mem != NULL)
+        munmap(ring_mem, ring_mem_size);
+    recv_buffers = NULL;
+    buf_ring = NULL;
+    sqes = NULL;
+    ring_mem = NULL;
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+static void uring_recv(conn_t* conn)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    // no more than conn->in has room for, so nothing received is lost;
+    // the reactor answers 400 rather than ask with a full buffer
+    sqe->len = CONN_INBUF - conn->in_len < RECV_BUFSIZE ? CONN_INBUF - conn->in_len : RECV_BUFSIZE;
+    set_data(sqe, conn, OP_RECV);
+    conn->pending = OP_RECV;
+}
+
+static void uring_send(conn_t* conn)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->response.iov + conn->response.iovpos);
+    sqe->len = conn->response.iovcnt - conn->response.iovpos;
+    set_data(sqe, conn, OP_SEND);
+    conn->pending = OP_SEND;
+}
+
+static void uring_read_file(conn_t* conn)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = conn->file_fd;
+    sqe->addr = (uint64_t) (uintptr_t) conn->out;
+    sqe->len = conn->file_left < CONN_WINDOW ? conn->file_left : CONN_WINDOW;
+    sqe->off = conn->file_offset;
+    set_data(sqe, conn, OP_READ_FILE);
+    conn->pending = OP_READ_FILE;
+}
+
+static void uring_close(conn_t* conn)
+{
+    struct io_uring_sqe* sqe;
+
+    if (conn->file_fd != -1)
+    {
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = conn->file_fd;
+        set_data(sqe, NULL, OP_IGNORE);
+        conn->file_fd = -1;
+    }
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    set_data(sqe, conn, OP_CLOSE);
+    conn->pending = OP_CLOSE;
+}
+
+// The cancelled operation completes with -ECANCELED. If it finished
+// in the meantime the cancel finds nothing and is ignored.
+static void uring_abort(conn_t* conn)
+{
+    struct io_uring_sqe* sqe;
+
+    if (conn->pending == 0 || conn->pending == OP_CLOSE)
+        return;
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) conn | conn->pending;
+    set_data(sqe, NULL, OP_IGNORE);
+}
+
+// Cancels the multishot accept. Its last completion, without
+// IORING_CQE_F_MORE, tells the reactor that accepting has stopped.
+static void uring_stop_accept()
+{
+    struct io_uring_sqe* sqe;
+
+    accept_stopping = 1;
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT; // user_data of the accept: no connection, OP_ACCEPT
+    set_data(sqe, NULL, OP_IGNORE);
+}
+
+static void handle_cqe(struct io_uring_cqe* cqe)
+{
+    int op = cqe->user_data & OP_MASK;
+    conn_t* conn = (conn_t*) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    int res = cqe->res;
+
+    switch (op)
+    {
+    case OP_ACCEPT:
+        if (res >= 0)
+            reactor_on_accept(res);
+        else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED && res != -ECANCELED)
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        // multishot stops on errors and overflow; start it again
+        // unless it was cancelled on purpose
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            if (accept_stopping)
+                reactor_on_accept_stopped();
+            else
+                arm_accept();
+        }
+        break;
+
+    case OP_WAKE:
+        reactor_on_wake();
+        arm_wake();
+        break;
+
+    case OP_RECV:
+        if (res == -ENOBUFS)
+        {
+            // every receive buffer is in use; try again next pass
+            uring_recv(conn);
+            break;
+        }
+        if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+        {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            memcpy(conn->in + conn->in_len, recv_buffers + bid * RECV_BUFSIZE, res);
+            recycle_buffer(bid);
+        }
+        reactor_on_recv(conn, res < 0 ? -1 : res);
+        break;
+
+    case OP_SEND:
+        reactor_on_sent(conn, res < 0 ? -1 : res);
+        break;
+
+    case OP_READ_FILE:
+        reactor_on_file_read(conn, res < 0 ? -1 : res);
+        break;
+
+    case OP_CLOSE:
+        reactor_on_closed(conn);
+        break;
+    }
+}
+
+static int uring_wait(int timeout_ms)
+{
+    unsigned head, tail;
+    int count = 0;
+    int rc;
+
+    rc = ring_submit(1, timeout_ms);
+    if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+    {
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        handle_cqe(&cqes[head & *cq_mask]);
+        head++;
+        count++;
+        // callbacks queue new entries; let the kernel see the freed slots
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (head == tail)
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return count;
+}
+
+#else /* !HAVE_IO_URING */
+
+static int uring_init(int listenfd, int wakefd)
+{
+    return -1;
+}
+
+static void uring_recv(conn_t* conn) { }
+static void uring_send(conn_t* conn) { }
+static void uring_read_file(conn_t* conn) { }
+static void uring_close(conn_t* conn) { }
+static void uring_abort(conn_t* conn) { }
+static void uring_stop_accept() { }
+static int uring_wait(int timeout_ms) { return -1; }
+
+#endif /* HAVE_IO_URING */
+
+io_backend_t uring_backend =
+{
+    "io_uring",
+    uring_init,
+    uring_recv,
+    uring_send,
+    uring_read_file,
+    uring_close,
+    uring_abort,
+    uring_stop_accept,
+    uring_wait
+};
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+                   LOAD GENERATOR
+
+Replays a testsuite trace against a running server the way
+http_test.py does (threads x requests x trace, one connection per
+request), but from C so the client isn't the bottleneck, and reports
+throughput and latency percentiles. Used by testsuite/bench_backends.sh
+to compare the blocking, epoll and io_uring front ends.
+
+usage: loadgen host port tracefile [threads]
+
+*/
+
+#define MAX_PATHS 64
+#define PATH_SIZE 256
+#define BUFSIZE 16384
+
+typedef struct
+{
+    int threads;
+    int requests;
+    char paths[MAX_PATHS][PATH_SIZE];
+    int num_paths;
+} trace_t;
+
+typedef struct
+{
+    int id;
+    double* latencies; // ms
+    int count;
+    int failures;
+} worker_t;
+
+static trace_t trace;
+static struct sockaddr_in server;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Reads the [configuration] and [trace*] sections. Every trace section
+// is merged into one list; assertions after the path are ignored.
+static int parse_trace(const char* file)
+{
+    char line[PATH_SIZE];
+    int in_trace = 0;
+    FILE* f = fopen(file, "r");
+
+    if (f == NULL)
+    {
+        perror(file);
+        return -1;
+    }
+
+    trace.threads = 1;
+    trace.requests = 1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '%')
+            continue;
+        if (line[0] == '[')
+        {
+            in_trace = strncmp(line, "[trace", 6) == 0;
+            continue;
+        }
+        if (!in_trace)
+        {
+            sscanf(line, "threads=%d", &trace.threads);
+            sscanf(line, "requests=%d", &trace.requests);
+        }
+        else if (trace.num_paths < MAX_PATHS)
+        {
+            line[strcspn(line, " ")] = '\0';
+            strcpy(trace.paths[trace.num_paths++], line);
+        }
+    }
+    fclose(f);
+    return trace.num_paths > 0 ? 0 : -1;
+}
+
+// One HTTP/1.0 request; returns 0 when a 200 came back in full.
+static int do_request(const char* path)
+{
+    char buf[BUFSIZE];
+    int fd, len, flag = 1;
+    ssize_t n;
+    int ok = 0;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(fd, (struct sockaddr*) &server, sizeof(server)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n\r\n", path);
+    if (write(fd, buf, len) != len)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // read to EOF; only the status line is checked
+    n = read(fd, buf, sizeof(buf));
+    if (n > 12 && strncmp(buf + 9, "200", 3) == 0)
+        ok = 1;
+    while (n > 0)
+        n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return (ok && n == 0) ? 0 : -1;
+}
+
+static void* run_worker(void* arg)
+{
+    worker_t* w = (worker_t*) arg;
+    int i, j;
+
+    for (i = 0; i < trace.requests; i++)
+    {
+        for (j = 0; j < trace.num_paths; j++)
+        {
+            double start = now_ms();
+            if (do_request(trace.paths[j]) != 0)
+                w->failures++;
+            w->latencies[w->count++] = now_ms() - start;
+        }
+    }
+    return NULL;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[])
+{
+    struct hostent* host;
+    pthread_t* threads;
+    worker_t* workers;
+    double* all;
+    double start, elapsed, sum = 0;
+    int per_thread, total = 0, failures = 0;
+    int i, j;
+
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s host port tracefile [threads]\n", argv[0]);
+        return 1;
+    }
+    if (parse_trace(argv[3]) != 0)
+        return 1;
+    if (argc > 4)
+        trace.threads = atoi(argv[4]);
+
+    host = gethostbyname(argv[1]);
+    if (host == NULL)
+    {
+        fprintf(stderr, "unknown host %s\n", argv[1]);
+        return 1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[2]));
+    memcpy(&server.sin_addr, host->h_addr_list[0], host->h_length);
+
+    per_thread = trace.requests * trace.num_paths;
+    threads = malloc(trace.threads * sizeof(pthread_t));
+    workers = calloc(trace.threads, sizeof(worker_t));
+
+    start = now_ms();
+    for (i = 0; i < trace.threads; i++)
+    {
+        workers[i].id = i;
+        workers[i].latencies = malloc(per_thread * sizeof(double));
+        pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+    }
+    for (i = 0; i < trace.threads; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now_ms() - start;
+
+    all = malloc(trace.threads * per_thread * sizeof(double));
+    for (i = 0; i < trace.threads; i++)
+    {
+        for (j = 0; j < workers[i].count; j++)
+        {
+            all[total++] = workers[i].latencies[j];
+            sum += workers[i].latencies[j];
+        }
+        failures += workers[i].failures;
+    }
+    qsort(all, total, sizeof(double), compare_double);
+
+    printf("requests %d  failed %d  time %.2f s  %.0f req/s\n",
+           total, failures, elapsed / 1000, total / (elapsed / 1000));
+    printf("latency ms: avg %.3f  p50 %.3f  p99 %.3f  max %.3f\n",
+           sum / total, all[total / 2], all[(int) (total * 0.99)], all[total - 1]);
+    return failures != 0;
+}
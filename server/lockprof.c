@@ -0,0 +1,201 @@
+#ifdef LOCK_PROFILE
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lockprof.h"
+
+/*
+                   LOCK PROFILER
+
+Wraps the lock sites of the thread pool, the seats and the standby
+list. For every class of lock it counts acquisitions, and counts as
+contended those the first try didn't get. It keeps log2 histograms of
+how long an acquisition waited and how long the lock was then held, in
+nanoseconds.
+
+A contended acquisition is found by trying the lock first, so an
+uncontended one costs a trylock and two clock reads. The histograms
+are updated with relaxed atomic adds; a reader sees every counter
+exactly, but not all of them at the same instant.
+
+Hold times are measured from the acquisition to the release by the
+same thread, kept in a thread-local start time per class. No thread
+holds two locks of one class at once. pthread_cond_wait() releases the
+lock while it sleeps, so its wrappers end the hold before the wait and
+start a new one after it. The time spent re-acquiring the lock on
+wakeup is not counted as a wait, because it can't be told apart from
+waiting for the condition.
+
+The counters appear in /stats and in the report printed at shutdown.
+
+*/
+
+#define BUCKETS 32 // bucket i counts times from 2^i ns to 2^(i+1) ns; the last one counts the rest
+
+typedef struct
+{
+    long acquired;
+    long contended;
+    long long wait_ns;
+    long long hold_ns;
+    long wait_hist[BUCKETS];
+    long hold_hist[BUCKETS];
+} lock_stats_t;
+
+static const char* const class_names[NUM_LOCK_CLASSES] =
+{
+    "pool",
+    "seat",
+    "standby"
+};
+
+static lock_stats_t lock_stats[NUM_LOCK_CLASSES];
+static __thread long long held_since[NUM_LOCK_CLASSES];
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bucket(long long ns)
+{
+    int b = 63 - __builtin_clzll((unsigned long long) ns | 1);
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+static void add(long* counter, long n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void acquired(lock_class_t class, long long start, int contended)
+{
+    lock_stats_t* s = &lock_stats[class];
+    long long now = now_ns();
+
+    add(&s->acquired, 1);
+    if (contended)
+    {
+        add(&s->contended, 1);
+        __atomic_fetch_add(&s->wait_ns, now - start, __ATOMIC_RELAXED);
+        add(&s->wait_hist[bucket(now - start)], 1);
+    }
+    else
+        add(&s->wait_hist[0], 1);
+    held_since[class] = now;
+}
+
+static void released(lock_class_t class)
+{
+    lock_stats_t* s = &lock_stats[class];
+    long long held = now_ns() - held_since[class];
+
+    __atomic_fetch_add(&s->hold_ns, held, __ATOMIC_RELAXED);
+    add(&s->hold_hist[bucket(held)], 1);
+}
+
+void prof_lock(pthread_mutex_t* mutex, lock_class_t class)
+{
+    long long start;
+
+    if (pthread_mutex_trylock(mutex) == 0)
+    {
+        acquired(class, 0, 0);
+        return;
+    }
+    start = now_ns();
+    pthread_mutex_lock(mutex);
+    acquired(class, start, 1);
+}
+
+void prof_unlock(pthread_mutex_t* mutex, lock_class_t class)
+{
+    released(class);
+    pthread_mutex_unlock(mutex);
+}
+
+int prof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, lock_class_t class)
+{
+    int ret;
+
+    released(class);
+    ret = pthread_cond_wait(cond, mutex);
+    held_since[class] = now_ns();
+    return ret;
+}
+
+int prof_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                        const struct timespec* deadline, lock_class_t class)
+{
+    int ret;
+
+    released(class);
+    ret = pthread_cond_timedwait(cond, mutex, deadline);
+    held_since[class] = now_ns();
+    return ret;
+}
+
+void prof_sem_wait(m_sem_t* sem, lock_class_t class)
+{
+    long long start;
+
+    if (sem_trywait(sem) == 0)
+    {
+        acquired(class, 0, 0);
+        return;
+    }
+    start = now_ns();
+    sem_wait(sem);
+    acquired(class, start, 1);
+}
+
+void prof_sem_post(m_sem_t* sem, lock_class_t class)
+{
+    released(class);
+    sem_post(sem);
+}
+
+static int format_hist(char* buf, int size, const char* name, const char* kind, long* hist)
+{
+    int len = snprintf(buf, size, "lock %s %s_hist", name, kind);
+    int b;
+
+    for (b = 0; b < BUCKETS && len < size; b++)
+    {
+        long n = __atomic_load_n(&hist[b], __ATOMIC_RELAXED);
+        if (n > 0)
+            len += snprintf(buf + len, size - len, " %lld:%ld", 1LL << b, n);
+    }
+    if (len < size)
+        len += snprintf(buf + len, size - len, "\n");
+    return len;
+}
+
+int lockprof_format(char* buf, int size)
+{
+    int len = 0;
+    int c;
+
+    for (c = 0; c < NUM_LOCK_CLASSES && len < size; c++)
+    {
+        lock_stats_t* s = &lock_stats[c];
+
+        len += snprintf(buf + len, size - len,
+                "lock %s acquired %ld contended %ld wait_ns %lld hold_ns %lld\n",
+                class_names[c],
+                __atomic_load_n(&s->acquired, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->contended, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->hold_ns, __ATOMIC_RELAXED));
+        if (len < size)
+            len += format_hist(buf + len, size - len, class_names[c], "wait", s->wait_hist);
+        if (len < size)
+            len += format_hist(buf + len, size - len, class_names[c], "hold", s->hold_hist);
+    }
+    return len < size ? len : size - 1;
+}
+
+#endif
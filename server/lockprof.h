@@ -0,0 +1,54 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+#include <pthread.h>
+
+#include "m_semaphore.h"
+
+// Lock contention profiler, see lockprof.c. Built in with
+// "make LOCK_PROFILE=1"; otherwise the macros below are the plain
+// pthread calls and nothing is recorded.
+typedef enum
+{
+    LOCK_POOL,    // the thread pool's queue lock
+    LOCK_SEAT,    // the per-seat mutexes
+    LOCK_STANDBY, // the standby list semaphore
+    NUM_LOCK_CLASSES
+} lock_class_t;
+
+#ifdef LOCK_PROFILE
+
+void prof_lock(pthread_mutex_t* mutex, lock_class_t class);
+void prof_unlock(pthread_mutex_t* mutex, lock_class_t class);
+int prof_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, lock_class_t class);
+int prof_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                        const struct timespec* deadline, lock_class_t class);
+void prof_sem_wait(m_sem_t* sem, lock_class_t class);
+void prof_sem_post(m_sem_t* sem, lock_class_t class);
+
+// Appends the counters and histograms as "lock ..." lines. Returns the length.
+int lockprof_format(char* buf, int size);
+
+#define PROF_LOCK(mutex, class) prof_lock(mutex, class)
+#define PROF_UNLOCK(mutex, class) prof_unlock(mutex, class)
+#define PROF_COND_WAIT(cond, mutex, class) prof_cond_wait(cond, mutex, class)
+#define PROF_COND_TIMEDWAIT(cond, mutex, deadline, class) \
+    prof_cond_timedwait(cond, mutex, deadline, class)
+#define PROF_SEM_WAIT(sem, class) prof_sem_wait(sem, class)
+#define PROF_SEM_POST(sem, class) prof_sem_post(sem, class)
+
+#else
+
+#define lockprof_format(buf, size) 0
+
+#define PROF_LOCK(mutex, class) pthread_mutex_lock(mutex)
+#define PROF_UNLOCK(mutex, class) pthread_mutex_unlock(mutex)
+#define PROF_COND_WAIT(cond, mutex, class) pthread_cond_wait(cond, mutex)
+#define PROF_COND_TIMEDWAIT(cond, mutex, deadline, class) \
+    pthread_cond_timedwait(cond, mutex, deadline)
+#define PROF_SEM_WAIT(sem, class) sem_wait(sem)
+#define PROF_SEM_POST(sem, class) sem_post(sem)
+
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <dlfcn.h>
+
+/*
+                   MALLOC COUNTER
+
+LD_PRELOAD shim that counts heap allocations (malloc, calloc, realloc)
+and prints the totals when the process exits. Used by
+testsuite/count_allocs.sh to measure allocations per request:
+
+    LD_PRELOAD=./malloc_count.so ./http_server
+
+dlsym() itself may call calloc before the real one is known; those
+early calls are served from a small static buffer.
+
+*/
+
+static void* (*real_malloc)(size_t);
+static void* (*real_calloc)(size_t, size_t);
+static void* (*real_realloc)(void*, size_t);
+
+static long mallocs, callocs, reallocs;
+
+static char early[4096];
+static size_t early_used;
+
+static void find_real()
+{
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+}
+
+void* malloc(size_t size)
+{
+    if (real_malloc == NULL)
+        find_real();
+    __atomic_fetch_add(&mallocs, 1, __ATOMIC_RELAXED);
+    return real_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    if (real_calloc == NULL)
+    {
+        // called from dlsym while looking the real functions up
+        void* p = early + early_used;
+        early_used += (n * size + 15) & ~(size_t) 15;
+        return p;
+    }
+    __atomic_fetch_add(&callocs, 1, __ATOMIC_RELAXED);
+    return real_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if (real_realloc == NULL)
+        find_real();
+    __atomic_fetch_add(&reallocs, 1, __ATOMIC_RELAXED);
+    return real_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+    static void (*real_free)(void*);
+
+    if ((char*) ptr >= early && (char*) ptr < early + sizeof(early))
+        return;
+    if (real_free == NULL)
+        real_free = dlsym(RTLD_NEXT, "free");
+    real_free(ptr);
+}
+
+__attribute__((destructor))
+static void report()
+{
+    fprintf(stderr, "malloc_count: malloc %ld calloc %ld realloc %ld\n",
+            mallocs, callocs, reallocs);
+}
@@ -0,0 +1,617 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "util.h"
+#include "stats.h"
+#include "arena.h"
+#include "seats.h"
+
+/*
+                   REACTOR
+
+Event driven front end for the server. One thread (the one that calls
+reactor_run) does all socket I/O through a backend (epoll or io_uring):
+it accepts connections, reads request headers, and once a request is
+complete hands the connection to the thread pool. The worker only
+builds the response; it puts the connection on the done list and wakes
+the reactor through an eventfd, and the reactor sends the response and
+closes the connection.
+
+Workers never block on a client, so a slow client only costs a
+connection slot. Connection structs are reused through a free list,
+so steady state serving does not allocate.
+
+Change feed subscribers (/seat_events) stay with the reactor. One that
+is caught up waits on the idle subscriber list. When a worker hands a
+connection back, the reactor checks the seat map version. If there are
+new changes it renders them from the change ring once, into a shared
+block, and points every caught-up subscriber's response at that block.
+Blocks are reused through a free list like the connections. Fanning
+out to thousands of subscribers is one render and one send each, and
+since only the reactor thread touches subscribers and blocks, there is
+no lock. A subscriber still busy sending the last
+block catches up by itself from the ring when it's done.
+
+Every connection the reactor owns has a deadline on the timer wheel:
+for the request headers, for the next request on a kept-alive
+connection, or for progress while sending. When it expires the
+operation in flight is aborted and the connection closed. A request
+that has been handed to a worker has no deadline.
+
+reactor_stop() drains the reactor for a restart or shutdown. Accepting
+stops, idle kept-alive connections and subscribers are closed, and
+requests in progress finish under their usual deadlines without
+keep-alive. reactor_run() returns once the last connection is closed.
+
+*/
+
+static io_backend_t* backend;
+static pool_t* threadpool;
+
+// connections finished by workers, waiting for the reactor to send them
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static conn_t* done_head = NULL;
+static conn_t* done_tail = NULL;
+static int wakefd = -1;
+
+// Events shared by all the subscribers sent them; the last one to let
+// go puts the block back on free_blocks for the next fan out.
+#define FEED_BLOCK_SIZE CONN_WINDOW
+#define FEED_HEARTBEAT_MS 15000
+
+typedef struct feed_block_t
+{
+    int refs;
+    int len;
+    struct feed_block_t* next; // on free_blocks
+    char data[FEED_BLOCK_SIZE];
+} feed_block_t;
+
+static const char feed_heartbeat[] = ": ping\n\n";
+
+// reactor thread only
+static conn_t* free_conns = NULL;
+static feed_block_t* free_blocks = NULL;
+static conn_t* feed_idle = NULL;        // caught up subscribers
+static unsigned long long feed_version; // changes fanned out so far
+static timer_wheel_t wheel;
+static long long loop_now; // ms, updated once per pass of the event loop
+static int live_conns;     // accepted and not yet closed
+static int draining;       // reactor_stop() has been seen
+static int accept_open;    // the backend may still accept connections
+
+static int stop_requested; // set by reactor_stop() from any thread
+static const int* adopted; // connections for reactor_run() to start with
+static int num_adopted;
+
+static conn_t* conn_alloc();
+static void conn_release(conn_t* conn);
+static void conn_finish(conn_t* conn);
+static void conn_deadline(conn_t* conn, int timeout_ms);
+static void conn_expired(wheel_timer_t* timer);
+static void start_drain();
+static void dispatch(conn_t* conn);
+static void feed_next(conn_t* conn);
+static void feed_fanout();
+static void feed_unwait(conn_t* conn);
+static void feed_release(conn_t* conn);
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int parse_io_mode(const char* name)
+{
+    if (strcmp(name, "auto") == 0)
+        return IO_AUTO;
+    if (strcmp(name, "blocking") == 0)
+        return IO_BLOCKING;
+    if (strcmp(name, "epoll") == 0)
+        return IO_EPOLL;
+    if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+        return IO_URING;
+    return -1;
+}
+
+int reactor_run(int listenfd, io_mode_t mode, pool_t* pool)
+{
+    threadpool = pool;
+    loop_now = now_ms();
+    wheel_init(&wheel, loop_now);
+    feed_version = seats_version();
+
+    // the backends never wait in accept()
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    // run again after a stop, e.g. when a restart fell through
+    __atomic_store_n(&stop_requested, 0, __ATOMIC_RELEASE);
+    if (wakefd >= 0)
+        close(wakefd);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd < 0)
+    {
+        perror("eventfd");
+        return -1;
+    }
+
+    backend = NULL;
+    if (mode == IO_URING || mode == IO_AUTO)
+    {
+        if (uring_backend.init(listenfd, wakefd) == 0)
+            backend = &uring_backend;
+        else if (mode == IO_URING)
+            fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+    }
+    if (backend == NULL)
+    {
+        if (epoll_backend.init(listenfd, wakefd) != 0)
+            return -1;
+        backend = &epoll_backend;
+    }
+    printf("Using %s backend\n", backend->name);
+    fflush(stdout);
+    live_conns = 0;
+    draining = 0;
+    accept_open = 1;
+    while (num_adopted > 0)
+    {
+        reactor_on_accept(*adopted++);
+        num_adopted--;
+    }
+
+    while (!draining || accept_open || live_conns > 0)
+    {
+        backend->wait(wheel_timeout(&wheel, loop_now));
+        loop_now = now_ms();
+        wheel_expire(&wheel, loop_now, conn_expired);
+        if (!draining && __atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE))
+            start_drain();
+    }
+    return 0;
+}
+
+void reactor_adopt(const int* fds, int count)
+{
+    adopted = fds;
+    num_adopted = count;
+}
+
+void reactor_stop()
+{
+    uint64_t one = 1;
+
+    __atomic_store_n(&stop_requested, 1, __ATOMIC_RELEASE);
+    if (wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+// No new connections; connections with nothing in progress are closed
+// now, the rest as soon as their response is out.
+static void start_drain()
+{
+    draining = 1;
+    backend->stop_accept();
+    wheel_fire_all(&wheel, conn_expired);
+}
+
+void reactor_on_accept_stopped()
+{
+    accept_open = 0;
+}
+
+/*
+    Pool routine: builds the response, then gives the connection back
+    to the reactor.
+ */
+void* reactor_work(void* arg)
+{
+    conn_t* conn = (conn_t*) arg;
+    uint64_t one = 1;
+    int was_empty;
+
+    serve_request(conn);
+    // nothing the reactor sends from lives in the arena
+    arena_reset(worker_arena());
+    conn->request = NULL;
+
+    pthread_mutex_lock(&done_lock);
+    conn->next = NULL;
+    was_empty = (done_head == NULL);
+    if (done_tail != NULL)
+        done_tail->next = conn;
+    else
+        done_head = conn;
+    done_tail = conn;
+    pthread_mutex_unlock(&done_lock);
+
+    // one wakeup covers everything queued before the reactor drains the list
+    if (was_empty && write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+
+    return NULL;
+}
+
+void reactor_on_wake()
+{
+    conn_t* conn;
+
+    pthread_mutex_lock(&done_lock);
+    conn = done_head;
+    done_head = NULL;
+    done_tail = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    while (conn != NULL)
+    {
+        conn_t* next = conn->next;
+        conn->state = CONN_SENDING;
+        conn_deadline(conn, SEND_TIMEOUT_MS);
+        backend->send(conn);
+        conn = next;
+    }
+
+    // the work just finished may have changed seats
+    feed_fanout();
+}
+
+void reactor_on_accept(int fd)
+{
+    conn_t* conn = conn_alloc();
+
+    STATS_INC(accepted);
+    live_conns++;
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    conn->in_len = 0;
+    conn->header_len = 0;
+    conn->file_fd = -1;
+    conn->file_left = 0;
+    conn->produce = NULL;
+    conn->subscriber = 0;
+    conn->feed_block = NULL;
+    conn->pending = 0;
+    conn->io_flags = 0;
+    conn_deadline(conn, HEADER_TIMEOUT_MS);
+    backend->recv(conn);
+}
+
+void reactor_on_recv(conn_t* conn, int n)
+{
+    int end;
+
+    if (n <= 0)
+    {
+        conn_finish(conn);
+        return;
+    }
+
+    // the first byte of the next request starts its header deadline
+    if (conn->state == CONN_IDLE)
+    {
+        conn->state = CONN_READING;
+        conn_deadline(conn, HEADER_TIMEOUT_MS);
+    }
+
+    end = http_header_end(conn->in, conn->in_len + n, conn->in_len);
+    conn->in_len += n;
+
+    if (end > 0)
+    {
+        conn->header_len = end;
+        dispatch(conn);
+    }
+    else if (conn->in_len == CONN_INBUF)
+    {
+        // headers too large; serve_request answers 400
+        conn->header_len = -1;
+        dispatch(conn);
+    }
+    else
+        backend->recv(conn);
+}
+
+// Hands a complete request to the pool, unless the pool is overloaded
+// or full; then the reactor answers 503 itself and the reactor thread
+// never waits for the pool.
+static void dispatch(conn_t* conn)
+{
+    wheel_remove(&wheel, &conn->timer);
+    conn->state = CONN_WORKING;
+    conn->keep_alive = !draining;
+    conn->subscriber = !draining;
+
+    if (pool_overloaded(threadpool))
+        STATS_INC(shed_overload);
+    else if (pool_try_add_task(threadpool, conn) != 0)
+        STATS_INC(shed_full);
+    else
+        return;
+
+    conn->keep_alive = 0;
+    conn->subscriber = 0;
+    conn->file_fd = -1;
+    conn->file_left = 0;
+    conn->produce = NULL;
+    response_error(&conn->response, STATUS_UNAVAILABLE);
+    conn->state = CONN_SENDING;
+    conn_deadline(conn, SEND_TIMEOUT_MS);
+    backend->send(conn);
+}
+
+// Starts over on a kept-alive connection. Requests the client sent
+// ahead (pipelined) are already in the buffer.
+static void conn_next_request(conn_t* conn)
+{
+    int end;
+
+    conn->in_len -= conn->header_len;
+    memmove(conn->in, conn->in + conn->header_len, conn->in_len);
+    conn->header_len = 0;
+
+    end = conn->in_len > 0 ? http_header_end(conn->in, conn->in_len, 0) : -1;
+    if (end > 0)
+    {
+        conn->header_len = end;
+        dispatch(conn);
+        return;
+    }
+    if (conn->in_len == CONN_INBUF)
+    {
+        // a full buffer and still no end of headers: 400, as above
+        conn->header_len = -1;
+        dispatch(conn);
+        return;
+    }
+
+    conn->state = conn->in_len > 0 ? CONN_READING : CONN_IDLE;
+    conn_deadline(conn, conn->in_len > 0 ? HEADER_TIMEOUT_MS : IDLE_TIMEOUT_MS);
+    backend->recv(conn);
+}
+
+void reactor_on_sent(conn_t* conn, int n)
+{
+    if (n < 0)
+    {
+        conn_finish(conn);
+        return;
+    }
+
+    // the deadline is for making progress, not for the whole response
+    if (n > 0)
+        conn_deadline(conn, SEND_TIMEOUT_MS);
+
+    if (response_advance(&conn->response, n) > 0)
+        backend->send(conn);
+    else if (conn->file_left > 0)
+        backend->read_file(conn);
+    else if (next_window(conn))
+        backend->send(conn);
+    else if (conn->subscriber && !draining)
+        feed_next(conn);
+    else if (conn->keep_alive && !draining)
+        conn_next_request(conn);
+    else
+        conn_finish(conn);
+}
+
+void reactor_on_file_read(conn_t* conn, int n)
+{
+    if (n <= 0)
+    {
+        conn_finish(conn);
+        return;
+    }
+
+    conn->file_offset += n;
+    conn->file_left -= n;
+    response_continue(&conn->response, conn->out, n);
+    backend->send(conn);
+}
+
+void reactor_on_closed(conn_t* conn)
+{
+    conn_release(conn);
+}
+
+// A subscriber finished sending: send it what it is still missing, or
+// have it wait for the next fan out.
+static void feed_next(conn_t* conn)
+{
+    int len;
+
+    feed_release(conn);
+
+    len = seat_events_render(conn->out, CONN_WINDOW, &conn->stream_since, seats_version());
+    if (len > 0)
+    {
+        response_continue(&conn->response, conn->out, len);
+        conn_deadline(conn, SEND_TIMEOUT_MS);
+        backend->send(conn);
+        return;
+    }
+
+    conn->state = CONN_SUBSCRIBED;
+    conn->feed_prev = NULL;
+    conn->feed_next = feed_idle;
+    if (feed_idle != NULL)
+        feed_idle->feed_prev = conn;
+    feed_idle = conn;
+    conn_deadline(conn, FEED_HEARTBEAT_MS);
+}
+
+static void feed_unwait(conn_t* conn)
+{
+    if (conn->feed_prev != NULL)
+        conn->feed_prev->feed_next = conn->feed_next;
+    else
+        feed_idle = conn->feed_next;
+    if (conn->feed_next != NULL)
+        conn->feed_next->feed_prev = conn->feed_prev;
+    conn->state = CONN_SENDING;
+}
+
+static feed_block_t* feed_block_alloc()
+{
+    feed_block_t* block = free_blocks;
+
+    if (block != NULL)
+        free_blocks = block->next;
+    else
+        block = (feed_block_t*) malloc(sizeof(feed_block_t));
+    block->refs = 0;
+    return block;
+}
+
+static void feed_block_put(feed_block_t* block)
+{
+    block->next = free_blocks;
+    free_blocks = block;
+}
+
+static void feed_release(conn_t* conn)
+{
+    feed_block_t* block = conn->feed_block;
+
+    if (block != NULL && --block->refs == 0)
+        feed_block_put(block);
+    conn->feed_block = NULL;
+}
+
+// Sends the changes since the last fan out to every waiting subscriber.
+static void feed_fanout()
+{
+    unsigned long long from = feed_version;
+    unsigned long long upto = seats_version();
+    feed_block_t* block;
+    conn_t* conn;
+
+    if (upto == from)
+        return;
+    if (feed_idle == NULL)
+    {
+        feed_version = upto;
+        return;
+    }
+
+    block = feed_block_alloc();
+    block->len = seat_events_render(block->data, FEED_BLOCK_SIZE, &feed_version, upto);
+
+    conn = feed_idle;
+    while (conn != NULL)
+    {
+        conn_t* next = conn->feed_next;
+
+        // subscribers that caught up on their own since the last fan out
+        // are somewhere else in the ring
+        if (conn->stream_since == from && block->len > 0)
+        {
+            feed_unwait(conn);
+            block->refs++;
+            conn->feed_block = block;
+            conn->stream_since = feed_version;
+            response_continue(&conn->response, block->data, block->len);
+            conn_deadline(conn, SEND_TIMEOUT_MS);
+            backend->send(conn);
+        }
+        else if (conn->stream_since != from)
+        {
+            feed_unwait(conn);
+            feed_next(conn);
+        }
+        conn = next;
+    }
+
+    if (block->refs == 0)
+        feed_block_put(block);
+}
+
+static void conn_finish(conn_t* conn)
+{
+    if (conn->state == CONN_SUBSCRIBED)
+        feed_unwait(conn);
+    feed_release(conn);
+    wheel_remove(&wheel, &conn->timer);
+    conn->state = CONN_CLOSING;
+    backend->close(conn);
+}
+
+static void conn_deadline(conn_t* conn, int timeout_ms)
+{
+    wheel_add(&wheel, &conn->timer, loop_now + timeout_ms);
+}
+
+// A client was too slow: fail whatever is in flight, and the callback
+// for it closes the connection.
+static void conn_expired(wheel_timer_t* timer)
+{
+    conn_t* conn = (conn_t*) timer->data;
+
+    if (draining)
+    {
+        // start_drain() fires every timer; only idle connections go now
+        if (conn->state == CONN_SUBSCRIBED)
+        {
+            conn_finish(conn);
+            return;
+        }
+        if (conn->state != CONN_IDLE && timer->expires > loop_now)
+        {
+            wheel_add(&wheel, timer, timer->expires);
+            return;
+        }
+        if (conn->state == CONN_IDLE)
+        {
+            conn->keep_alive = 0;
+            backend->abort(conn);
+            return;
+        }
+    }
+
+    // quiet subscribers get a comment line, which also finds out
+    // whether the client is still there
+    if (conn->state == CONN_SUBSCRIBED)
+    {
+        feed_unwait(conn);
+        response_continue(&conn->response, feed_heartbeat, sizeof(feed_heartbeat) - 1);
+        conn_deadline(conn, SEND_TIMEOUT_MS);
+        backend->send(conn);
+        return;
+    }
+
+    STATS_INC(timeouts);
+    conn->keep_alive = 0;
+    backend->abort(conn);
+}
+
+static conn_t* conn_alloc()
+{
+    conn_t* conn = free_conns;
+
+    if (conn != NULL)
+        free_conns = conn->next;
+    else
+    {
+        conn = (conn_t*) malloc(sizeof(conn_t));
+        wheel_timer_init(&conn->timer, conn);
+    }
+    return conn;
+}
+
+static void conn_release(conn_t* conn)
+{
+    live_conns--;
+    conn->next = free_conns;
+    free_conns = conn;
+}
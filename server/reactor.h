@@ -0,0 +1,65 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "conn.h"
+#include "thread_pool.h"
+
+typedef enum
+{
+    IO_AUTO,     // io_uring if the kernel has it, epoll otherwise
+    IO_BLOCKING, // accept and hand the socket to a worker
+    IO_EPOLL,
+    IO_URING
+} io_mode_t;
+
+// An I/O backend for the reactor. Operations are started on a
+// connection and complete later through the reactor_on_* callbacks
+// below, always on the reactor thread. Only one operation is in
+// flight per connection.
+typedef struct io_backend_t
+{
+    const char* name;
+    int (*init)(int listenfd, int wakefd);
+    void (*recv)(conn_t* conn);      // append to conn->in
+    void (*send)(conn_t* conn);      // write conn->response
+    void (*read_file)(conn_t* conn); // next window of conn->file_fd into conn->out
+    void (*close)(conn_t* conn);     // close the socket and any open file
+    void (*abort)(conn_t* conn);     // fail the recv/send/read in flight (its callback gets -1)
+    void (*stop_accept)();           // accept no more; reactor_on_accept_stopped() follows
+    int (*wait)(int timeout_ms);     // wait for and dispatch completions
+} io_backend_t;
+
+extern io_backend_t epoll_backend;
+extern io_backend_t uring_backend;
+
+// Parses "auto", "blocking", "epoll" or "uring". Returns -1 otherwise.
+int parse_io_mode(const char* name);
+
+// Runs the event loop on listenfd until reactor_stop(). Requests are
+// handed to pool, which must have been created with reactor_work as its
+// routine. Returns 0 once stopped and drained, or -1 if the backend
+// can't be set up; IO_URING and IO_AUTO fall back to epoll when
+// io_uring is unavailable.
+int reactor_run(int listenfd, io_mode_t mode, pool_t* pool);
+
+// Connections accepted elsewhere (see restart_takeover()) for the next
+// reactor_run() to start with. fds must stay valid until it does.
+void reactor_adopt(const int* fds, int count);
+
+// Asks reactor_run() to stop accepting, finish the requests in
+// progress and return. Callable from any thread.
+void reactor_stop();
+
+// Pool routine for the event driven modes.
+void* reactor_work(void* conn);
+
+// Completion callbacks for the backends.
+void reactor_on_accept(int fd);
+void reactor_on_recv(conn_t* conn, int n);
+void reactor_on_sent(conn_t* conn, int n);
+void reactor_on_file_read(conn_t* conn, int n);
+void reactor_on_closed(conn_t* conn);
+void reactor_on_wake();
+void reactor_on_accept_stopped();
+
+#endif
@@ -0,0 +1,481 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "replica.h"
+#include "seats.h"
+#include "stats.h"
+
+/*
+                   HOT STANDBY
+
+A primary started with -R path streams every seat change to a follower
+started with -F path, over a Unix domain socket. The follower keeps its
+own copy of the seats and serves nothing until the primary is gone; then
+it binds the port and takes over with the seats as of the last change
+it received.
+
+The primary's sender thread reads the changes off the same ring as the
+change feed (seats.c), so confirm and cancel never wait for the
+follower: a change costs them a fence and a load, plus a pipe write
+when the sender is asleep. Everything that piled up while the last
+batch was being written goes out as the next one, in one writev(), so
+the batches grow with the load. The follower applies a batch and sends
+back the version it has reached, but the primary does not wait for that
+before sending on; the acknowledgements only feed replica_lag in /stats
+and the final flush in replica_stop().
+
+On the wire, in host byte order (both ends are on one machine):
+
+    batch header    magic, kind, count, standby
+    changes         count seat_change_t
+    standby list    standby ints, if standby >= 0
+
+A batch of kind BATCH_CHECKPOINT is followed by a seats_save()
+checkpoint instead. One starts every connection, and another is sent if
+the sender falls more than the ring behind. It is written while the
+seats keep changing, so the changes from the version read before it are
+sent again after it; seats_apply() skips any the seat already has. An
+idle primary sends an empty batch every REPLICA_HEARTBEAT_MS, so a
+follower that hears nothing for REPLICA_TIMEOUT_MS knows the primary is
+hung rather than quiet.
+
+A follower that loses the primary first tries to bind the port; if
+that fails, the primary is still serving (or restarting, see restart.c)
+and the follower connects to it again for a fresh checkpoint.
+
+*/
+
+#define REPLICA_MAGIC 0x4c504552 // "REPL"
+
+enum { BATCH_CHANGES, BATCH_CHECKPOINT };
+
+typedef struct
+{
+    unsigned magic;
+    int kind;
+    int count;   // changes that follow
+    int standby; // standby ids after the changes, -1 if the list is unchanged
+} batch_header_t;
+
+// The primary's view of its follower.
+typedef struct
+{
+    int fd;
+    unsigned long long cursor; // last change sent
+    unsigned long long acked;  // last version the follower reported
+    unsigned generation;       // standby list generation sent
+    unsigned char ack[sizeof(unsigned long long)]; // a partly read acknowledgement
+    int ack_len;
+    long long last_sent;       // ms
+} follower_t;
+
+static int listen_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static int sleeping;  // the sender waits for a change
+static int stopping;  // replica_stop() was called
+static pthread_t sender;
+
+// follower side
+static int loaded;    // a checkpoint was (at least partly) loaded
+static int synced;    // and all of it
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len)
+{
+    char* p = (char*) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        while (count > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Change hook, on the thread that changed a seat. Only a sleeping
+// sender costs a system call.
+static void replica_wake()
+{
+    char byte = 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED))
+    {
+        if (write(wake_pipe[1], &byte, 1) < 0 && errno != EAGAIN)
+            perror("replica wake");
+    }
+}
+
+static void drain_wake_pipe()
+{
+    char drain[64];
+
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+}
+
+// Takes in whatever acknowledgements have arrived. Returns -1 once the
+// follower has gone.
+static int read_acks(follower_t* f)
+{
+    unsigned char buf[256];
+    ssize_t n;
+    int i;
+
+    while ((n = recv(f->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            f->ack[f->ack_len++] = buf[i];
+            if (f->ack_len == sizeof(f->ack))
+            {
+                memcpy(&f->acked, f->ack, sizeof(f->acked));
+                f->ack_len = 0;
+            }
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return -1;
+    STATS_SET(replica_lag, (long) (seats_version() - f->acked));
+    return 0;
+}
+
+static int send_checkpoint(follower_t* f)
+{
+    batch_header_t header = { REPLICA_MAGIC, BATCH_CHECKPOINT, 0, 0 };
+    int ids[STANDBY_SIZE];
+
+    // read before the checkpoint, so nothing made during it is missed
+    f->cursor = seats_version();
+    seats_standby(ids, STANDBY_SIZE, &f->generation);
+
+    STATS_INC(replica_resyncs);
+    f->last_sent = now_ms();
+    if (write_all(f->fd, &header, sizeof(header)) != 0 || seats_save(f->fd) != 0)
+        return -1;
+    return 0;
+}
+
+// Sleeps until a change, an acknowledgement or timeout_ms, unless
+// there is something to send already.
+static void wait_for_work(follower_t* f, int timeout_ms)
+{
+    struct pollfd fds[2] = { { wake_pipe[0], POLLIN, 0 }, { f->fd, POLLIN, 0 } };
+    seat_change_t change;
+
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if (seat_change_read(f->cursor + 1, &change) == 0
+        && seats_standby_generation() == f->generation
+        && !__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+        poll(fds, 2, timeout_ms);
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    drain_wake_pipe();
+}
+
+// Streams changes to one follower until it goes away, or until
+// replica_stop() and the follower has acknowledged everything.
+static void stream(follower_t* f)
+{
+    seat_change_t batch[REPLICA_BATCH];
+    int ids[STANDBY_SIZE];
+    batch_header_t header;
+    struct iovec iov[3];
+    long long stop_deadline = 0;
+    int rc, idle;
+
+    if (send_checkpoint(f) != 0)
+        return;
+
+    while (1)
+    {
+        header.magic = REPLICA_MAGIC;
+        header.kind = BATCH_CHANGES;
+        header.count = 0;
+        header.standby = -1;
+
+        rc = 1;
+        while (header.count < REPLICA_BATCH
+               && (rc = seat_change_read(f->cursor + 1, &batch[header.count])) == 1)
+        {
+            f->cursor++;
+            header.count++;
+        }
+        if (rc < 0)
+        {
+            // fell more than the ring behind
+            if (send_checkpoint(f) != 0)
+                return;
+            continue;
+        }
+        if (seats_standby_generation() != f->generation)
+            header.standby = seats_standby(ids, STANDBY_SIZE, &f->generation);
+
+        if (read_acks(f) != 0)
+            return;
+
+        idle = header.count == 0 && header.standby < 0;
+        if (idle && __atomic_load_n(&stopping, __ATOMIC_RELAXED))
+        {
+            struct pollfd ack = { f->fd, POLLIN, 0 };
+
+            if (stop_deadline == 0)
+                stop_deadline = now_ms() + REPLICA_TIMEOUT_MS;
+            if (f->acked >= f->cursor || now_ms() >= stop_deadline)
+                return;
+            poll(&ack, 1, (int) (stop_deadline - now_ms()));
+            continue;
+        }
+        if (idle && now_ms() - f->last_sent < REPLICA_HEARTBEAT_MS)
+        {
+            wait_for_work(f, (int) (REPLICA_HEARTBEAT_MS - (now_ms() - f->last_sent)));
+            continue;
+        }
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = batch;
+        iov[1].iov_len = header.count * sizeof(seat_change_t);
+        iov[2].iov_base = ids;
+        iov[2].iov_len = header.standby > 0 ? header.standby * sizeof(int) : 0;
+        if (writev_all(f->fd, iov, 3) != 0)
+            return;
+        f->last_sent = now_ms();
+        STATS_INC(replica_batches);
+        STATS_ADD(replica_changes, header.count);
+    }
+}
+
+// The primary's sender: one follower at a time.
+static void* replica_thread(void* arg)
+{
+    struct pollfd fds[2] = { { wake_pipe[0], POLLIN, 0 }, { listen_fd, POLLIN, 0 } };
+    follower_t follower;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+    {
+        if (poll(fds, 2, -1) < 0 || !(fds[1].revents & POLLIN))
+        {
+            drain_wake_pipe();
+            continue;
+        }
+
+        memset(&follower, 0, sizeof(follower));
+        follower.fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (follower.fd < 0)
+            continue;
+        printf("Follower connected\n");
+        fflush(stdout);
+        stream(&follower);
+        close(follower.fd);
+        printf("Follower gone at version %llu\n", follower.acked);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+int replica_serve(const char* path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "replica: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    stopping = 0; // serving again after a restart fell through
+    if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        perror("replica pipe");
+        return -1;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perror("replica socket");
+        return -1;
+    }
+    // left behind by an earlier primary, which is gone or handing over
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listen_fd, 1) != 0)
+    {
+        perror("replica bind");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    seats_on_change(replica_wake);
+    if (pthread_create(&sender, NULL, replica_thread, NULL) != 0)
+    {
+        perror("replica thread");
+        seats_on_change(NULL);
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    printf("Replicating on %s\n", path);
+    return 0;
+}
+
+void replica_stop()
+{
+    char byte = 0;
+
+    if (listen_fd < 0)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    if (write(wake_pipe[1], &byte, 1) < 0 && errno != EAGAIN)
+        perror("replica wake");
+    pthread_join(sender, NULL);
+    seats_on_change(NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
+
+// Applies batches from the primary, acknowledging each, until the
+// connection fails or goes quiet.
+static void follow(int fd)
+{
+    batch_header_t header;
+    seat_change_t batch[REPLICA_BATCH];
+    int ids[STANDBY_SIZE];
+    unsigned long long version;
+    struct timeval timeout = { REPLICA_TIMEOUT_MS / 1000, (REPLICA_TIMEOUT_MS % 1000) * 1000 };
+    int i;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (read_all(fd, &header, sizeof(header)) == 0 && header.magic == REPLICA_MAGIC)
+    {
+        if (header.kind == BATCH_CHECKPOINT)
+        {
+            synced = 0;
+            if (loaded)
+                unload_seats();
+            loaded = 1;
+            if (seats_load(fd) != 0)
+                return;
+            synced = 1;
+            printf("Copied %d seats at version %llu\n", seat_count(), seats_version());
+            fflush(stdout);
+        }
+        else
+        {
+            if (!synced || header.count < 0 || header.count > REPLICA_BATCH
+                || header.standby > STANDBY_SIZE)
+                return;
+            if (read_all(fd, batch, header.count * sizeof(seat_change_t)) != 0)
+                return;
+            if (header.standby > 0 && read_all(fd, ids, header.standby * sizeof(int)) != 0)
+                return;
+            for (i = 0; i < header.count; i++)
+                seats_apply(&batch[i]);
+            if (header.standby >= 0)
+                seats_set_standby(ids, header.standby);
+        }
+
+        version = seats_version();
+        if (write_all(fd, &version, sizeof(version)) != 0)
+            return;
+    }
+}
+
+void replica_follow(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    while (1)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+        {
+            follow(fd);
+            if (synced)
+            {
+                printf("Lost the primary at version %llu\n", seats_version());
+                fflush(stdout);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        if (synced)
+            return;
+        usleep(100 * 1000);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef _REPLICA_H_
+#define _REPLICA_H_
+
+// Hot standby replication, see replica.c.
+
+#define REPLICA_BATCH 512          // most changes in one batch
+#define REPLICA_HEARTBEAT_MS 500   // an idle primary sends an empty batch this often
+#define REPLICA_TIMEOUT_MS 2000    // a follower gives up on a primary silent this long
+
+// Primary: listens on the Unix socket at path and streams the seat
+// changes to a follower from a thread of its own. Call once the seats
+// are loaded. Returns -1 if the socket can't be set up.
+int replica_serve(const char* path);
+
+// Primary, before exiting: sends what is left, waits (at most
+// REPLICA_TIMEOUT_MS) for the follower to acknowledge it, and closes.
+void replica_stop();
+
+// Follower: copies the seats from the primary at path and applies its
+// changes until the primary goes away. Returns then, with the seats as
+// of the last change received, or keeps trying if it never got them.
+void replica_follow(const char* path);
+
+#endif
@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "request.h"
+
+/*
+                   REQUEST PARSER
+
+Single pass parser for HTTP requests. The request line, query
+parameters and headers are all recorded as slices into the caller's
+buffer, so parsing does not allocate or copy anything. Query parameters
+are split on '&', and also on '?' and ';' since some clients use those
+as separators too.
+
+The route table maps a path to a small integer through a perfect hash,
+so routing a request costs one hash of the path and one compare
+instead of a chain of string compares.
+
+*/
+
+#define ROUTE_SLOT_MASK (MAX_ROUTES - 1)
+#define MAX_SEED_TRIES 100000
+
+static void parse_query(http_request_t* req);
+static const char* line_end(const char* p, const char* end, const char** next);
+static unsigned int route_hash(unsigned int seed, const char* str, int len);
+
+// Scans for the blank line ending the headers. Accepts bare '\n' line
+// endings as well as "\r\n".
+int http_header_end(const char* buf, int len, int from)
+{
+    const char* p;
+    const char* end = buf + len;
+
+    // the terminator may have started in the previous chunk
+    p = buf + from - 3;
+    if (p < buf)
+        p = buf;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        if (p + 1 < end && p[1] == '\n')
+            return p + 2 - buf;
+        if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+            return p + 3 - buf;
+        p++;
+    }
+    return 0;
+}
+
+// Returns the end of the line starting at p, not counting the "\r\n".
+// *next is set to the start of the following line.
+static const char* line_end(const char* p, const char* end, const char** next)
+{
+    const char* nl = memchr(p, '\n', end - p);
+
+    if (nl == NULL)
+    {
+        *next = end;
+        return end;
+    }
+    *next = nl + 1;
+    if (nl > p && nl[-1] == '\r')
+        return nl - 1;
+    return nl;
+}
+
+int http_parse_request(const char* buf, int len, http_request_t* req)
+{
+    const char* end = buf + len;
+    const char* next;
+    const char* eol;
+    const char* p;
+    const char* sp;
+
+    req->num_params = 0;
+    req->num_headers = 0;
+    req->query.ptr = NULL;
+    req->query.len = 0;
+
+    // request line: method, target and an optional version
+    eol = line_end(buf, end, &next);
+
+    sp = memchr(buf, ' ', eol - buf);
+    if (sp == NULL || sp == buf)
+        return -1;
+    req->method.ptr = buf;
+    req->method.len = sp - buf;
+
+    p = sp + 1;
+    sp = memchr(p, ' ', eol - p);
+    if (sp == NULL)
+        sp = eol; // HTTP/0.9 style requests have no version
+    if (sp == p)
+        return -1;
+    req->target.ptr = p;
+    req->target.len = sp - p;
+
+    // split the target into path and query on the first '?'
+    req->path.ptr = p;
+    req->query.ptr = memchr(p, '?', sp - p);
+    if (req->query.ptr != NULL)
+    {
+        req->query.ptr++;
+        req->path.len = req->query.ptr - 1 - p;
+        req->query.len = sp - req->query.ptr;
+    }
+    else
+        req->path.len = sp - p;
+
+    if (sp < eol)
+        sp++;
+    req->version.ptr = sp;
+    req->version.len = eol - sp;
+
+    // headers, until the blank line
+    p = next;
+    while (p < end)
+    {
+        const char* colon;
+        http_field_t* field;
+
+        eol = line_end(p, end, &next);
+        if (eol == p)
+            break;
+
+        colon = memchr(p, ':', eol - p);
+        if (colon == NULL)
+            return -1;
+
+        if (req->num_headers < MAX_HEADERS)
+        {
+            const char* value = colon + 1;
+            const char* value_end = eol;
+
+            // trim surrounding whitespace
+            while (value < value_end && (*value == ' ' || *value == '\t'))
+                value++;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                value_end--;
+
+            field = &req->headers[req->num_headers++];
+            field->name.ptr = p;
+            field->name.len = colon - p;
+            field->value.ptr = value;
+            field->value.len = value_end - value;
+        }
+        p = next;
+    }
+
+    parse_query(req);
+    return 0;
+}
+
+// Splits the query string into name=value pairs. Extra pairs past
+// MAX_PARAMS are dropped.
+static void parse_query(http_request_t* req)
+{
+    const char* p = req->query.ptr;
+    const char* end = p + req->query.len;
+
+    while (p != NULL && p < end && req->num_params < MAX_PARAMS)
+    {
+        http_field_t* field = &req->params[req->num_params];
+        const char* start = p;
+        const char* eq = NULL;
+
+        while (p < end && *p != '&' && *p != '?' && *p != ';')
+        {
+            if (*p == '=' && eq == NULL)
+                eq = p;
+            p++;
+        }
+
+        if (p > start)
+        {
+            field->name.ptr = start;
+            if (eq != NULL)
+            {
+                field->name.len = eq - start;
+                field->value.ptr = eq + 1;
+                field->value.len = p - eq - 1;
+            }
+            else
+            {
+                field->name.len = p - start;
+                field->value.ptr = p;
+                field->value.len = 0;
+            }
+            req->num_params++;
+        }
+        p++;
+    }
+}
+
+int slice_eq(slice_t s, const char* str)
+{
+    int len = strlen(str);
+    return s.len == len && memcmp(s.ptr, str, len) == 0;
+}
+
+int slice_case_eq(slice_t s, const char* str)
+{
+    int len = strlen(str);
+    return s.len == len && strncasecmp(s.ptr, str, len) == 0;
+}
+
+slice_t request_param(const http_request_t* req, const char* name)
+{
+    int i;
+    int len = strlen(name);
+    slice_t none = { NULL, 0 };
+
+    for (i = 0; i < req->num_params; i++)
+    {
+        const http_field_t* param = &req->params[i];
+        if (param->name.len == len && memcmp(param->name.ptr, name, len) == 0)
+            return param->value;
+    }
+    return none;
+}
+
+slice_t request_header(const http_request_t* req, const char* name)
+{
+    int i;
+    slice_t none = { NULL, 0 };
+
+    for (i = 0; i < req->num_headers; i++)
+    {
+        if (slice_case_eq(req->headers[i].name, name))
+            return req->headers[i].value;
+    }
+    return none;
+}
+
+int request_int_param(const http_request_t* req, const char* name)
+{
+    slice_t value = request_param(req, name);
+    int i;
+    int result = 0;
+
+    for (i = 0; i < value.len && isdigit((unsigned char) value.ptr[i]); i++)
+    {
+        int digit = value.ptr[i] - '0';
+
+        // saturate rather than wrap around to a negative id
+        if (result > (INT_MAX - digit) / 10)
+            return INT_MAX;
+        result = result * 10 + digit;
+    }
+    return result;
+}
+
+// Tries seeds until every name hashes to a different slot. With a
+// handful of routes in MAX_ROUTES slots this takes a few tries.
+int route_table_build(route_table_t* table, const char* const* names, int n)
+{
+    unsigned int seed;
+    int i;
+
+    if (n > MAX_ROUTES)
+        return -1;
+
+    for (seed = 1; seed < MAX_SEED_TRIES; seed++)
+    {
+        int collision = 0;
+
+        for (i = 0; i < MAX_ROUTES; i++)
+            table->index[i] = -1;
+
+        for (i = 0; i < n && !collision; i++)
+        {
+            int len = strlen(names[i]);
+            unsigned int slot = route_hash(seed, names[i], len) & ROUTE_SLOT_MASK;
+
+            if (table->index[slot] != -1)
+                collision = 1;
+            else
+            {
+                table->index[slot] = i;
+                table->names[slot] = names[i];
+                table->lengths[slot] = len;
+            }
+        }
+
+        if (!collision)
+        {
+            table->seed = seed;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int route_lookup(const route_table_t* table, slice_t path)
+{
+    unsigned int slot = route_hash(table->seed, path.ptr, path.len) & ROUTE_SLOT_MASK;
+
+    if (table->index[slot] == -1 || table->lengths[slot] != path.len)
+        return -1;
+    if (memcmp(table->names[slot], path.ptr, path.len) != 0)
+        return -1;
+    return table->index[slot];
+}
+
+// FNV-1a, seeded.
+static unsigned int route_hash(unsigned int seed, const char* str, int len)
+{
+    unsigned int h = 2166136261u ^ seed;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) str[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
@@ -0,0 +1,73 @@
+#ifndef _REQUEST_H_
+#define _REQUEST_H_
+
+#define MAX_HEADERS 32
+#define MAX_PARAMS 16
+#define MAX_ROUTES 32
+
+// A piece of the request buffer. Nothing is copied out of the buffer
+// while parsing, so slices are only valid as long as the buffer is.
+typedef struct slice_t
+{
+    const char* ptr;
+    int len;
+} slice_t;
+
+typedef struct http_field_t
+{
+    slice_t name;
+    slice_t value;
+} http_field_t;
+
+typedef struct http_request_t
+{
+    slice_t method;
+    slice_t target; // path and query as sent
+    slice_t path;
+    slice_t query;
+    slice_t version;
+    http_field_t params[MAX_PARAMS];
+    int num_params;
+    http_field_t headers[MAX_HEADERS];
+    int num_headers;
+} http_request_t;
+
+// Route table keyed by a perfect hash of the path. The hash seed is
+// searched for once at build time so every route lands in its own slot,
+// and a lookup is one hash and one compare.
+typedef struct route_table_t
+{
+    unsigned int seed;
+    const char* names[MAX_ROUTES];
+    int lengths[MAX_ROUTES];
+    int index[MAX_ROUTES];
+} route_table_t;
+
+// Returns the length of the header block (request line, headers and the
+// blank line) if buf holds all of it, 0 if more data is needed. Only the
+// bytes from 'from' on are scanned, so it can be called after each read.
+int http_header_end(const char* buf, int len, int from);
+
+// Parses the request line, query string and headers in one pass.
+// Returns 0 on success, -1 if the request is malformed.
+int http_parse_request(const char* buf, int len, http_request_t* req);
+
+int slice_eq(slice_t s, const char* str);
+int slice_case_eq(slice_t s, const char* str);
+
+// Looks up a query parameter or header by name.
+slice_t request_param(const http_request_t* req, const char* name);
+slice_t request_header(const http_request_t* req, const char* name);
+
+// Leading digits of a query parameter, 0 if missing or not a number,
+// INT_MAX if larger than that.
+int request_int_param(const http_request_t* req, const char* name);
+
+// Builds a table for n route names. Returns -1 if no seed separates them.
+int route_table_build(route_table_t* table, const char* const* names, int n);
+
+// Returns the position of path in the names given to route_table_build,
+// or -1 if it is not a route.
+int route_lookup(const route_table_t* table, slice_t path);
+
+#endif
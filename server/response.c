@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "response.h"
+
+/*
+                   RESPONSE WRITER
+
+Responses are sent with a single writev(): the status line and headers
+for every status/content type pair are formatted once at startup, the
+Content-Length line is the only thing formatted per response, and the
+body is pointed to rather than copied. Error responses are prebuilt
+whole, body and all.
+
+*/
+
+#define HEADER_BLOCK_SIZE 128
+#define ERROR_RESPONSE_SIZE 256
+
+static const char* status_lines[NUM_STATUS] =
+{
+    "200 OK",
+    "400 BAD REQUEST",
+    "404 FILE NOT FOUND",
+    "503 SERVICE UNAVAILABLE"
+};
+
+static const char* type_names[NUM_TYPES] =
+{
+    "text/html",
+    "text/plain",
+    "image/png",
+    "text/css",
+    "application/javascript",
+    SEAT_MAP_TYPE,
+    "text/event-stream"
+};
+
+static const char* error_bodies[NUM_STATUS] =
+{
+    "",
+    "<html><body><h2>BAD REQUEST</h2></body></html>\n",
+    "<html><body bgColor=white text=black>\n"
+    "<h2>404 FILE NOT FOUND</h2>\n"
+    "</body></html>\n",
+    "<html><body><h2>SERVICE UNAVAILABLE</h2></body></html>\n"
+};
+
+// extra headers for the canned error responses
+static const char* error_headers[NUM_STATUS] =
+{
+    "",
+    "",
+    "",
+    "Retry-After: 1\r\n"
+};
+
+static char header_blocks[NUM_STATUS][NUM_TYPES][HEADER_BLOCK_SIZE];
+static int header_lengths[NUM_STATUS][NUM_TYPES];
+
+// HTTP/1.1 200 headers for chunked bodies, [keep_alive][type]
+static char chunked_blocks[2][NUM_TYPES][HEADER_BLOCK_SIZE];
+static int chunked_lengths[2][NUM_TYPES];
+
+static char error_responses[NUM_STATUS][ERROR_RESPONSE_SIZE];
+static int error_lengths[NUM_STATUS];
+
+void init_responses()
+{
+    int status, type;
+
+    for (status = 0; status < NUM_STATUS; status++)
+    {
+        for (type = 0; type < NUM_TYPES; type++)
+        {
+            header_lengths[status][type] = snprintf(header_blocks[status][type], HEADER_BLOCK_SIZE,
+                    "HTTP/1.0 %s\r\n"
+                    "Content-type: %s\r\n",
+                    status_lines[status], type_names[type]);
+        }
+
+        error_lengths[status] = snprintf(error_responses[status], ERROR_RESPONSE_SIZE,
+                "HTTP/1.0 %s\r\n"
+                "Content-type: text/html\r\n"
+                "%s"
+                "Content-Length: %d\r\n\r\n"
+                "%s",
+                status_lines[status], error_headers[status],
+                (int) strlen(error_bodies[status]), error_bodies[status]);
+    }
+
+    for (type = 0; type < NUM_TYPES; type++)
+    {
+        int keep_alive;
+        for (keep_alive = 0; keep_alive < 2; keep_alive++)
+        {
+            chunked_lengths[keep_alive][type] = snprintf(chunked_blocks[keep_alive][type], HEADER_BLOCK_SIZE,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-type: %s\r\n"
+                    "Transfer-Encoding: chunked\r\n"
+                    "Connection: %s\r\n\r\n",
+                    type_names[type], keep_alive ? "keep-alive" : "close");
+        }
+    }
+}
+
+void response_start(response_t* res, http_status_t status, content_type_t type)
+{
+    res->iov[0].iov_base = header_blocks[status][type];
+    res->iov[0].iov_len = header_lengths[status][type];
+    res->iovcnt = 1;
+    res->iovpos = 0;
+}
+
+void response_body(response_t* res, const char* body, int len, int content_length)
+{
+    res->iov[1].iov_base = res->length_line;
+    res->iov[1].iov_len = snprintf(res->length_line, LENGTH_LINE_SIZE,
+            "Content-Length: %d\r\n\r\n", content_length);
+    res->iov[2].iov_base = (void*) body;
+    res->iov[2].iov_len = len;
+    res->iovcnt = 3;
+}
+
+void response_start_chunked(response_t* res, content_type_t type, int keep_alive)
+{
+    res->iov[0].iov_base = chunked_blocks[keep_alive != 0][type];
+    res->iov[0].iov_len = chunked_lengths[keep_alive != 0][type];
+    res->iovcnt = 1;
+    res->iovpos = 0;
+}
+
+void response_start_unsized(response_t* res, content_type_t type, const char* body, int len)
+{
+    response_start(res, STATUS_OK, type);
+    res->iov[1].iov_base = "\r\n";
+    res->iov[1].iov_len = 2;
+    res->iov[2].iov_base = (void*) body;
+    res->iov[2].iov_len = len;
+    res->iovcnt = 3;
+}
+
+void response_reset(response_t* res)
+{
+    res->iovcnt = 0;
+    res->iovpos = 0;
+}
+
+void response_chunk(response_t* res, const char* data, int len, int last)
+{
+    struct iovec* iov = res->iov + res->iovcnt;
+
+    // a zero length chunk would end the body early
+    if (len > 0)
+    {
+        iov->iov_base = res->length_line;
+        iov->iov_len = snprintf(res->length_line, LENGTH_LINE_SIZE, "%x\r\n", len);
+        iov++;
+        iov->iov_base = (void*) data;
+        iov->iov_len = len;
+        iov++;
+        iov->iov_base = last ? "\r\n0\r\n\r\n" : "\r\n";
+        iov->iov_len = last ? 7 : 2;
+        iov++;
+    }
+    else if (last)
+    {
+        iov->iov_base = "0\r\n\r\n";
+        iov->iov_len = 5;
+        iov++;
+    }
+    res->iovcnt = iov - res->iov;
+}
+
+void response_keep_alive(response_t* res)
+{
+    // the length line ends with the blank line; put the header before it
+    int len = res->iov[1].iov_len - 2;
+    res->iov[1].iov_len = len + snprintf(res->length_line + len, LENGTH_LINE_SIZE - len,
+            "Connection: keep-alive\r\n\r\n");
+}
+
+void response_continue(response_t* res, const char* data, int len)
+{
+    res->iov[0].iov_base = (void*) data;
+    res->iov[0].iov_len = len;
+    res->iovcnt = 1;
+    res->iovpos = 0;
+}
+
+void response_error(response_t* res, http_status_t status)
+{
+    res->iov[0].iov_base = error_responses[status];
+    res->iov[0].iov_len = error_lengths[status];
+    res->iovcnt = 1;
+    res->iovpos = 0;
+}
+
+int response_send(int fd, response_t* res)
+{
+    int total = 0;
+
+    while (res->iovpos < res->iovcnt)
+    {
+        ssize_t rc = writev(fd, res->iov + res->iovpos, res->iovcnt - res->iovpos);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += rc;
+        response_advance(res, rc);
+    }
+    return total;
+}
+
+int response_advance(response_t* res, int n)
+{
+    // skip what was written, the rest goes out in the next call
+    while (res->iovpos < res->iovcnt && n >= (int) res->iov[res->iovpos].iov_len)
+    {
+        n -= res->iov[res->iovpos].iov_len;
+        res->iovpos++;
+    }
+    if (res->iovpos < res->iovcnt)
+    {
+        struct iovec* iov = &res->iov[res->iovpos];
+        iov->iov_base = (char*) iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    return res->iovcnt - res->iovpos;
+}
+
+content_type_t content_type_for(const char* path, int len)
+{
+    const char* dot = NULL;
+    int i;
+
+    for (i = len - 1; i >= 0 && path[i] != '/'; i--)
+    {
+        if (path[i] == '.')
+        {
+            dot = path + i + 1;
+            break;
+        }
+    }
+    if (dot == NULL)
+        return TYPE_HTML;
+
+    len = path + len - dot;
+    if (len == 3 && strncasecmp(dot, "png", 3) == 0)
+        return TYPE_PNG;
+    if (len == 3 && strncasecmp(dot, "txt", 3) == 0)
+        return TYPE_PLAIN;
+    if (len == 3 && strncasecmp(dot, "css", 3) == 0)
+        return TYPE_CSS;
+    if (len == 2 && strncasecmp(dot, "js", 2) == 0)
+        return TYPE_JS;
+    return TYPE_HTML;
+}
@@ -0,0 +1,91 @@
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+
+#include <sys/uio.h>
+
+#define RESPONSE_IOVECS 4
+#define LENGTH_LINE_SIZE 64
+
+typedef enum
+{
+    STATUS_OK,
+    STATUS_BAD_REQUEST,
+    STATUS_NOT_FOUND,
+    STATUS_UNAVAILABLE,
+    NUM_STATUS
+} http_status_t;
+
+#define SEAT_MAP_TYPE "application/x-seat-map"
+
+typedef enum
+{
+    TYPE_HTML,
+    TYPE_PLAIN,
+    TYPE_PNG,
+    TYPE_CSS,
+    TYPE_JS,
+    TYPE_SEAT_MAP,
+    TYPE_EVENT_STREAM,
+    NUM_TYPES
+} content_type_t;
+
+// A response waiting to be sent: status line and headers come from
+// blocks built once by init_responses(), followed by the Content-Length
+// line and the body. The body is not copied, so it must stay valid
+// until the response is sent.
+typedef struct response_t
+{
+    struct iovec iov[RESPONSE_IOVECS];
+    int iovcnt;
+    int iovpos; // first iovec not yet completely sent
+    char length_line[LENGTH_LINE_SIZE]; // Content-Length and Connection lines
+} response_t;
+
+// Builds the header blocks. Call once before any response is made.
+void init_responses();
+
+// Starts a response with the given status and content type.
+void response_start(response_t* res, http_status_t status, content_type_t type);
+
+// Sets the body. content_length may be larger than len when the rest of
+// the body is written separately (e.g. a file sent in chunks).
+void response_body(response_t* res, const char* body, int len, int content_length);
+
+// Starts a 200 response whose body follows as chunks (HTTP/1.1
+// chunked transfer encoding). keep_alive picks the Connection header.
+void response_start_chunked(response_t* res, content_type_t type, int keep_alive);
+
+// Starts a 200 response without a Content-Length, for HTTP/1.0 clients
+// that can't take chunks; the body ends when the connection is closed.
+// The rest of the body follows as response_continue() pieces.
+void response_start_unsized(response_t* res, content_type_t type, const char* body, int len);
+
+// Empties the response, to build the next window of a chunked body.
+void response_reset(response_t* res);
+
+// Adds one chunk of a chunked body, and the final empty chunk if last.
+// The chunk size line goes in length_line, so only one chunk fits in
+// a response.
+void response_chunk(response_t* res, const char* data, int len, int last);
+
+// Adds "Connection: keep-alive" to a response that has a body.
+void response_keep_alive(response_t* res);
+
+// Replaces the response with just the next piece of a body whose
+// headers have already been sent.
+void response_continue(response_t* res, const char* data, int len);
+
+// A complete canned error response (headers and body).
+void response_error(response_t* res, http_status_t status);
+
+// Sends everything in one writev(), retrying on short writes.
+// Returns the number of bytes written or -1.
+int response_send(int fd, response_t* res);
+
+// Marks n more bytes as sent. Returns how many iovecs are left.
+int response_advance(response_t* res, int n);
+
+// Picks a content type from a file name's extension.
+content_type_t content_type_for(const char* path, int len);
+
+#endif
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "restart.h"
+#include "seats.h"
+
+/*
+                   GRACEFUL RESTART
+
+A restart (SIGHUP) replaces the running server with whatever binary is
+now at its path, without refusing a connection or losing a booking.
+
+  1. The old process starts the new binary with one end of a Unix
+     socket pair, named in SEATS_HANDOFF_FD, and keeps serving.
+  2. The new process sets up its pool and route table and writes a
+     ready byte. If it dies or takes longer than RESTART_READY_MS
+     instead, the restart is called off.
+  3. The old process sends the listening socket as SCM_RIGHTS
+     ancillary data right away, then stops accepting and drains:
+     queued and running requests finish and idle connections are
+     closed.
+  4. Meanwhile the new process accepts from the same socket and holds
+     up to RESTART_HOLD connections, unread, until the seats are in;
+     only past that do connections wait in the listen backlog.
+  5. Once drained, the old process sends the seat checkpoint. The new
+     process loads it, acknowledges it and starts on the connections
+     it holds. The old process exits once it has the acknowledgement.
+
+The listening socket is open in one process or the other the whole
+time, so clients never see a refused connection. If the checkpoint
+doesn't get through, the new process passes the connections it holds
+back over the channel, again as SCM_RIGHTS, and gives up; the old one
+adopts them and goes back to serving.
+
+*/
+
+#define RESTART_FD 3
+#define RESTART_FD_STR "3"
+
+#define RESTART_FDS_PER_MSG 64 // held connections passed back per message
+
+static pid_t child = -1; // old process: the new one
+
+static void close_from(int first)
+{
+    int fd, max;
+
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, first, ~0U, 0) == 0)
+        return;
+#endif
+    max = sysconf(_SC_OPEN_MAX);
+    for (fd = first; fd < max; fd++)
+        close(fd);
+}
+
+int restart_spawn(const char* exe, char* const argv[])
+{
+    int pair[2];
+    struct pollfd ready;
+    char byte;
+    pid_t pid;
+    sigset_t none;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    // The child may only make async-signal-safe calls before exec (other
+    // threads could hold the malloc lock), so the environment is set up
+    // here and inherited.
+    setenv(RESTART_ENV, RESTART_FD_STR, 1);
+    pid = fork();
+    if (pid != 0)
+        unsetenv(RESTART_ENV);
+    if (pid < 0)
+    {
+        perror("fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        // Only the channel survives the exec, as fd 3. A client socket
+        // or file left open in the new process would keep connections
+        // the old one closes from ever seeing the end.
+        if (pair[1] == RESTART_FD ? fcntl(RESTART_FD, F_SETFD, 0) != 0
+                                  : dup2(pair[1], RESTART_FD) < 0)
+            _exit(127);
+        close_from(RESTART_FD + 1);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execv(exe, argv);
+        _exit(127);
+    }
+
+    close(pair[1]);
+    child = pid;
+    ready.fd = pair[0];
+    ready.events = POLLIN;
+    if (poll(&ready, 1, RESTART_READY_MS) != 1 || read(pair[0], &byte, 1) != 1)
+    {
+        fprintf(stderr, "restart: new server did not start\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(pair[0]);
+        return -1;
+    }
+    return pair[0];
+}
+
+int restart_send_listener(int channel, int listenfd)
+{
+    char byte = 'L';
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listenfd, sizeof(int));
+
+    if (sendmsg(channel, &msg, MSG_NOSIGNAL) != 1)
+    {
+        perror("restart: listener");
+        return -1;
+    }
+    return 0;
+}
+
+// Sends one byte, with count descriptors attached if count > 0.
+static int send_fds(int channel, char byte, const int* fds, int count)
+{
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int) * RESTART_FDS_PER_MSG)];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count > 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    }
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Receives one byte, appending any descriptors attached to it to fds.
+// Returns 1, or 0 at the end of the channel, or -1.
+static int receive_fds(int channel, char* byte, int* fds, int* count, int max)
+{
+    struct iovec iov = { byte, 1 };
+    char control[CMSG_SPACE(sizeof(int) * RESTART_FDS_PER_MSG)];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    int n, i, fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return n;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (i = 0; i < (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*count < max)
+                fds[(*count)++] = fd;
+            else
+                close(fd);
+        }
+    }
+    return 1;
+}
+
+int restart_handoff(int channel, int* returned, int* num_returned)
+{
+    struct pollfd reply;
+    char byte;
+
+    *num_returned = 0;
+    if (seats_save(channel) != 0)
+    {
+        perror("restart: handoff");
+        // the end of the checkpoint tells the new process to give up
+        shutdown(channel, SHUT_WR);
+    }
+
+    // The acknowledgement, or the held connections coming back ('H')
+    reply.fd = channel;
+    reply.events = POLLIN;
+    while (poll(&reply, 1, RESTART_READY_MS) == 1
+           && receive_fds(channel, &byte, returned, num_returned, RESTART_HOLD) == 1)
+    {
+        if (byte == 'R' && *num_returned == 0)
+        {
+            close(channel);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "restart: new server did not take the seats, %d connections back\n",
+            *num_returned);
+    close(channel);
+    // it has given up, or is stuck; either way only one server may run
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    child = -1;
+    return -1;
+}
+
+int restart_inherited()
+{
+    const char* value = getenv(RESTART_ENV);
+    int channel;
+
+    if (value == NULL)
+        return -1;
+    channel = atoi(value);
+    unsetenv(RESTART_ENV);
+    return channel > 2 ? channel : -1;
+}
+
+int restart_takeover(int channel, int* held, int* num_held)
+{
+    char byte = 'R';
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct pollfd waiting[2];
+    int listenfd = -1;
+    int fd;
+
+    *num_held = 0;
+    if (write(channel, &byte, 1) != 1)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&listenfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (listenfd < 0)
+        return -1;
+
+    // The old process drains while we accept. The listener is shared
+    // with it, and it copes with a nonblocking one.
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    waiting[0].fd = listenfd;
+    waiting[0].events = POLLIN;
+    waiting[1].fd = channel;
+    waiting[1].events = POLLIN;
+    while (1)
+    {
+        if (*num_held == RESTART_HOLD)
+            waiting[0].fd = -1; // the rest wait in the backlog
+        if (poll(waiting, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (waiting[1].revents)
+        {
+            // the checkpoint, or the old process gave up on us
+            if (seats_load(channel) != 0 || write(channel, "R", 1) != 1)
+                break;
+            close(channel);
+            return listenfd;
+        }
+        if (waiting[0].revents && (fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+            held[(*num_held)++] = fd;
+    }
+
+    // Accepted from the old process's socket, so they go back to it
+    // rather than be reset.
+    for (fd = 0; fd < *num_held; fd += RESTART_FDS_PER_MSG)
+    {
+        int count = *num_held - fd < RESTART_FDS_PER_MSG ? *num_held - fd : RESTART_FDS_PER_MSG;
+        if (send_fds(channel, 'H', held + fd, count) != 0)
+            break;
+    }
+    while (*num_held > 0)
+        close(held[--(*num_held)]);
+    close(channel);
+    close(listenfd);
+    return -1;
+}
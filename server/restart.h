@@ -0,0 +1,36 @@
+#ifndef _RESTART_H_
+#define _RESTART_H_
+
+// Graceful restart, see restart.c.
+
+#define RESTART_ENV "SEATS_HANDOFF_FD"
+#define RESTART_READY_MS 10000 // how long the new process may take to start
+#define RESTART_HOLD 256        // most connections the new process accepts before it has the seats
+
+// Old process: starts exe with argv and waits until it is ready to take
+// over. Returns the channel to it, or -1 if it failed to start (this
+// process then simply goes on serving).
+int restart_spawn(const char* exe, char* const argv[]);
+
+// Old process, once the new one is ready: sends the listening socket
+// down the channel, so the new process accepts while this one drains.
+int restart_send_listener(int channel, int listenfd);
+
+// Old process, once drained: sends the seat checkpoint and waits for the
+// new process to acknowledge it. Closes the channel either way. Returns
+// -1 if the new process didn't get the seats; this one then goes on
+// serving, starting with the connections the new one held, which come
+// back in returned (up to RESTART_HOLD, counted in *num_returned).
+int restart_handoff(int channel, int* returned, int* num_returned);
+
+// New process: the channel from the old one, or -1 on a normal start.
+int restart_inherited();
+
+// New process: tells the old one it is ready and takes the listening
+// socket. Until the seats arrive it accepts up to RESTART_HOLD
+// connections into held, unread, and counts them in *num_held. Returns
+// the socket with the seats loaded, or -1 after passing those held
+// back to the old process.
+int restart_takeover(int channel, int* held, int* num_held);
+
+#endif
@@ -2,11 +2,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "seats.h"
 #include "m_semaphore.h"
+#include "lockprof.h"
 
-#define STANDBY_SIZE 8
+#define CHANGE_RING_SIZE 4096 // power of two
 
 // Standby List, represented using a linked list.
 // Customers are added to this when their seat is
@@ -21,30 +24,168 @@ typedef struct standby_l
 // the head of the standby linked list, the length, and
 // the semaphore object we use to control the list.
 seat_t* seat_header = NULL;
+seat_t** seat_index = NULL; // seat_index[id], so lookups and ranges don't walk the list
+int seat_total = 0;
+unsigned long long seat_version = 0; // bumped on every state change
 standbyL* head = NULL;
 int standby_length = 0;
 m_sem_t* semaphore;
 
+// Change ring: the last CHANGE_RING_SIZE state changes, the change with
+// version v in slot v % CHANGE_RING_SIZE. Each writer owns the slot of
+// the version it drew, so appending takes no lock. A slot's version is
+// cleared while it is rewritten and set last, so a reader that sees the
+// same version before and after copying the slot has a whole entry.
+typedef struct
+{
+    unsigned long long version;
+    int seat_id;
+    int state;
+    int customer_id;
+} change_slot_t;
+
+static change_slot_t change_ring[CHANGE_RING_SIZE];
+static unsigned long long change_floor; // changes up to this one are not on the ring
+static void (*change_hook)(); // told after every change, see seats_on_change()
+static unsigned standby_generation; // bumped on every standby list change
+
 char seat_state_to_char(seat_state_t);
 
-void list_seats(char* buf, int bufsize)
+// Records a state change: the seat gets the next map version and the
+// change goes on the ring.
+static void seat_changed(seat_t* seat)
 {
-    seat_t* curr = seat_header;
+    unsigned long long version = __atomic_add_fetch(&seat_version, 1, __ATOMIC_RELAXED);
+    change_slot_t* slot = &change_ring[version & (CHANGE_RING_SIZE - 1)];
+
+    __atomic_store_n(&seat->version, version, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->version, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->seat_id, seat->id, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->state, seat->state, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->customer_id, seat->customer_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->version, version, __ATOMIC_RELEASE);
+
+    if (change_hook != NULL)
+        change_hook();
+}
+
+void seats_on_change(void (*hook)())
+{
+    change_hook = hook;
+}
+
+// Reads change version from the ring. Returns 1 with the change in
+// *change, 0 if it hasn't been written yet, or -1 if it has already
+// been overwritten.
+int seat_change_read(unsigned long long version, seat_change_t* change)
+{
+    change_slot_t* slot = &change_ring[version & (CHANGE_RING_SIZE - 1)];
+    unsigned long long seen = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+
+    // made before a restart, by the previous process
+    if (version <= change_floor)
+        return -1;
+
+    if (seen != version)
+    {
+        if (seen > version || seats_version() >= version + CHANGE_RING_SIZE)
+            return -1;
+        return 0;
+    }
+
+    change->version = version;
+    change->seat_id = __atomic_load_n(&slot->seat_id, __ATOMIC_RELAXED);
+    change->state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+    change->customer_id = __atomic_load_n(&slot->customer_id, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&slot->version, __ATOMIC_RELAXED) == version ? 1 : -1;
+}
+
+// Renders the changes after *cursor, up to version upto, as
+// server-sent events ("id: version" and "data: seat state"), stopping
+// at the first change not written yet or when buf is full. A reader
+// that fell more than the ring behind gets a "reset" event carrying
+// the current version instead; it has to fetch the map again. Advances
+// *cursor and returns the number of bytes written.
+int seat_events_render(char* buf, int bufsize, unsigned long long* cursor, unsigned long long upto)
+{
+    char event[96];
     int index = 0;
-    while(curr != NULL && index < bufsize+ strlen("%d %c,"))
+    seat_change_t change;
+
+    while (*cursor < upto)
     {
-        int length = snprintf(buf+index, bufsize-index, 
-                "%d %c,", curr->id, seat_state_to_char(curr->state));
-        if (length > 0)
-            index = index + length;
-        curr = curr->next;
+        int length;
+        int rc = seat_change_read(*cursor + 1, &change);
+
+        if (rc == 0)
+            break;
+        if (rc < 0)
+            length = snprintf(event, sizeof(event), "id: %llu\nevent: reset\ndata: %llu\n\n",
+                    upto, upto);
+        else
+            length = snprintf(event, sizeof(event), "id: %llu\ndata: %d %c\n\n",
+                    change.version, change.seat_id, seat_state_to_char(change.state));
+
+        if (index + length > bufsize)
+            break;
+        memcpy(buf + index, event, length);
+        index += length;
+        *cursor = rc < 0 ? upto : *cursor + 1;
     }
-    if (index > 0)
-        snprintf(buf+index-1, bufsize-index-1, "\n");
+    return index;
+}
+
+// Lists as many seats as fit; list_seats_range() is for the rest.
+void list_seats(char* buf, int bufsize)
+{
+    int next = 0;
+    int length = list_seats_range(buf, bufsize - 1, &next, seat_total);
+
+    if (length > 0)
+        buf[length] = '\0';
     else
         snprintf(buf, bufsize, "No seats not found\n\n");
 }
 
+int seat_count()
+{
+    return seat_total;
+}
+
+// Renders seats *next up to (not including) end as "id state," with
+// a newline after the last one, stopping before a seat that wouldn't
+// fit whole. Advances *next past the seats written and returns the
+// number of bytes written (no terminating '\0').
+int list_seats_range(char* buf, int bufsize, int* next, int end)
+{
+    char entry[32];
+    int index = 0;
+    int id = *next;
+
+    if (end > seat_total)
+        end = seat_total;
+    if (id < 0)
+        id = 0;
+
+    for (; id < end; id++)
+    {
+        seat_t* seat = seat_index[id];
+        int length = snprintf(entry, sizeof(entry), "%d %c%c",
+                seat->id, seat_state_to_char(seat->state), id == end - 1 ? '\n' : ',');
+        if (index + length > bufsize)
+            break;
+        memcpy(buf + index, entry, length);
+        index += length;
+    }
+
+    *next = id;
+    return index;
+}
+
 void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int customer_priority)
 {
     seat_t* curr = seat_header;
@@ -58,6 +199,7 @@ void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int custom
                         curr->id, seat_state_to_char(curr->state));
                 curr->state = PENDING;
                 curr->customer_id = customer_id;
+                seat_changed(curr);
             }
             else
             {
@@ -67,7 +209,7 @@ void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int custom
                 // We add the customer to the end of the list if there's space.
                 if (standby_length != STANDBY_SIZE)
                 {
-                    sem_wait(semaphore);
+                    PROF_SEM_WAIT(semaphore, LOCK_STANDBY);
                     standbyL* new_standby = (standbyL*) malloc(sizeof(standbyL));
                     new_standby->customer_id = customer_id;
                     new_standby->next = NULL;
@@ -87,7 +229,10 @@ void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int custom
                     }
 
                     standby_length++;
-                    sem_post(semaphore);
+                    standby_generation++;
+                    PROF_SEM_POST(semaphore, LOCK_STANDBY);
+                    if (change_hook != NULL)
+                        change_hook();
                 }
 
             }
@@ -108,13 +253,14 @@ void confirm_seat(char* buf, int bufsize, int seat_id, int customer_id, int cust
     {
         if(curr->id == seat_id)
         {
-            pthread_mutex_lock(curr->mutex);
+            PROF_LOCK(curr->mutex, LOCK_SEAT);
             printf("Seat %d locked\n",seat_id );
             if(curr->state == PENDING && curr->customer_id == customer_id )
             {
                 snprintf(buf, bufsize, "Seat confirmed: %d %c\n\n",
                         curr->id, seat_state_to_char(curr->state));
                 curr->state = OCCUPIED;
+                seat_changed(curr);
             }
             else if(curr->customer_id != customer_id )
             {
@@ -124,7 +270,7 @@ void confirm_seat(char* buf, int bufsize, int seat_id, int customer_id, int cust
             {
                 snprintf(buf, bufsize, "No pending request\n\n");
             }
-            pthread_mutex_unlock(curr->mutex);
+            PROF_UNLOCK(curr->mutex, LOCK_SEAT);
             printf("Seat %d unlocked\n",seat_id );
             return;
         }
@@ -145,7 +291,7 @@ void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_p
     {
         if(curr->id == seat_id)
         {
-            pthread_mutex_lock(curr->mutex);
+            PROF_LOCK(curr->mutex, LOCK_SEAT);
             printf("Seat %d locked\n",seat_id );
             if(curr->state == PENDING && curr->customer_id == customer_id )
             {
@@ -158,16 +304,19 @@ void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_p
                 // this cancelled seat.
                 if (standby_length > 0)
                 {
-                    sem_wait(semaphore);
+                    PROF_SEM_WAIT(semaphore, LOCK_STANDBY);
                     curr->customer_id = head->customer_id;
                     head = head->next;
                     curr->state = OCCUPIED;
                     standby_length--;
-                    sem_post(semaphore);
+                    standby_generation++;
+                    seat_changed(curr);
+                    PROF_SEM_POST(semaphore, LOCK_STANDBY);
                 }
                 else
                 {
                     curr->state = AVAILABLE;
+                    seat_changed(curr);
                 }
             }
             else if(curr->customer_id != customer_id )
@@ -178,7 +327,7 @@ void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_p
             {
                 snprintf(buf, bufsize, "No pending request\n\n");
             }
-            pthread_mutex_unlock(curr->mutex);
+            PROF_UNLOCK(curr->mutex, LOCK_SEAT);
             printf("Seat %d unlocked\n",seat_id );
             return;
         }
@@ -190,23 +339,120 @@ void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_p
     return;
 }
 
+/*
+    Binary seat map. All numbers are little endian.
+
+    header (SEAT_MAP_HEADER_SIZE bytes)
+        0   'S' 'M'
+        2   format version, 1
+        3   kind: 0 full map, 1 changes
+        4   seat count (32 bits)
+        8   map version (64 bits)
+
+    A full map follows with 2 bits per seat, seat i in bits 2*(i%4)
+    of byte i/4 (0 available, 1 pending, 2 occupied). A change list
+    follows with one 32 bit record per changed seat, id << 2 | state.
+
+    The map version is read before the seats, so a seat that changes
+    while the map is sent may already show its newer state; it will be
+    in the next change list too, so a client that keeps asking for the
+    changes since the last version it saw never misses one.
+ */
+unsigned long long seats_version()
+{
+    return __atomic_load_n(&seat_version, __ATOMIC_RELAXED);
+}
+
+static void put32(unsigned char* p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+int seat_map_header(unsigned char* buf, int delta, unsigned long long version)
+{
+    buf[0] = 'S';
+    buf[1] = 'M';
+    buf[2] = 1;
+    buf[3] = delta ? 1 : 0;
+    put32(buf + 4, seat_total);
+    put32(buf + 8, (unsigned) version);
+    put32(buf + 12, (unsigned) (version >> 32));
+    return SEAT_MAP_HEADER_SIZE;
+}
+
+// Packs seats *next up to end, four to a byte. *next must be a
+// multiple of four. Returns the number of bytes written.
+int seat_map_pack(unsigned char* buf, int bufsize, int* next, int end)
+{
+    int id = *next;
+    int index = 0;
+
+    if (end > seat_total)
+        end = seat_total;
+
+    for (; id < end && index < bufsize; index++)
+    {
+        unsigned char packed = 0;
+        int k;
+        for (k = 0; k < 4 && id < end; k++, id++)
+            packed |= seat_index[id]->state << (2 * k);
+        buf[index] = packed;
+    }
+
+    *next = id;
+    return index;
+}
+
+// Writes a record for every seat from *next up to end that changed
+// after version since. Returns the number of bytes written.
+int seat_map_changes(unsigned char* buf, int bufsize, int* next, int end, unsigned long long since)
+{
+    int id = *next;
+    int index = 0;
+
+    if (end > seat_total)
+        end = seat_total;
+
+    for (; id < end && index + SEAT_MAP_RECORD_SIZE <= bufsize; id++)
+    {
+        seat_t* seat = seat_index[id];
+        if (__atomic_load_n(&seat->version, __ATOMIC_RELAXED) > since)
+        {
+            put32(buf + index, (unsigned) id << 2 | seat->state);
+            index += SEAT_MAP_RECORD_SIZE;
+        }
+    }
+
+    *next = id;
+    return index;
+}
+
 // A few more variables have been initialized here, namely a mutex
 // for each seat node and the main semaphore.
 void load_seats(int number_of_seats)
 {
     seat_t* curr = NULL;
     int i;
+
+    seat_index = (seat_t**) malloc(sizeof(seat_t*) * (number_of_seats > 0 ? number_of_seats : 1));
+    seat_total = number_of_seats;
+
     for(i = 0; i < number_of_seats; i++)
     {   
         seat_t* temp = (seat_t*) malloc(sizeof(seat_t));
         temp->id = i;
         temp->customer_id = -1;
         temp->state = AVAILABLE;
+        temp->version = 0;
         temp->next = NULL;
 
         pthread_mutex_t* mutex = (pthread_mutex_t*) malloc(sizeof(pthread_mutex_t));
         pthread_mutex_init(mutex, NULL);
         temp->mutex = mutex;
+        seat_index[i] = temp;
         
         if (seat_header == NULL)
         {
@@ -232,13 +478,215 @@ void unload_seats()
         seat_t* temp = curr;
         curr = curr->next;
         pthread_mutex_destroy(temp->mutex);
+        free(temp->mutex);
+        free(temp);
+    }
+    seat_header = NULL;
+    free(seat_index);
+    seat_index = NULL;
+    seat_total = 0;
+
+    while (head != NULL)
+    {
+        standbyL* temp = head;
+        head = head->next;
         free(temp);
     }
+    standby_length = 0;
 
     sem_destroy(semaphore);
     free(semaphore);    
 }
 
+/*
+    Checkpoint for a restart: a header, then every seat's holder, state
+    and version, then the standby list. Written and read on a socket or
+    file, so the new process picks up where this one stopped. A replica
+    checkpoint is taken while requests still change the seats: the
+    standby list is copied in one pass under the semaphore, and each
+    seat carries its own version, so a change that lands meanwhile is
+    sent again off the ring and applied or skipped by version.
+ */
+#define CHECKPOINT_MAGIC 0x53454154 // "SEAT"
+
+typedef struct
+{
+    unsigned magic;
+    int count;
+    unsigned long long version;
+    int standby;
+} checkpoint_header_t;
+
+typedef struct
+{
+    int customer_id;
+    int state;
+    unsigned long long version;
+} checkpoint_seat_t;
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* buf, size_t len)
+{
+    char* p = (char*) buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int seats_save(int fd)
+{
+    checkpoint_header_t header = { CHECKPOINT_MAGIC, seat_total, seats_version(), 0 };
+    checkpoint_seat_t record;
+    int ids[STANDBY_SIZE];
+    unsigned generation;
+    int i;
+
+    header.standby = seats_standby(ids, STANDBY_SIZE, &generation);
+    if (write_all(fd, &header, sizeof(header)) != 0)
+        return -1;
+    for (i = 0; i < seat_total; i++)
+    {
+        record.customer_id = seat_index[i]->customer_id;
+        record.state = seat_index[i]->state;
+        record.version = seat_index[i]->version;
+        if (write_all(fd, &record, sizeof(record)) != 0)
+            return -1;
+    }
+    if (write_all(fd, ids, header.standby * sizeof(int)) != 0)
+        return -1;
+    return 0;
+}
+
+int seats_load(int fd)
+{
+    checkpoint_header_t header;
+    checkpoint_seat_t record;
+    standbyL** tail = &head;
+    int i;
+
+    if (read_all(fd, &header, sizeof(header)) != 0 || header.magic != CHECKPOINT_MAGIC
+        || header.count < 0 || header.standby < 0)
+        return -1;
+
+    load_seats(header.count);
+    for (i = 0; i < header.count; i++)
+    {
+        if (read_all(fd, &record, sizeof(record)) != 0)
+            return -1;
+        seat_index[i]->customer_id = record.customer_id;
+        seat_index[i]->state = (seat_state_t) record.state;
+        seat_index[i]->version = record.version;
+    }
+    for (i = 0; i < header.standby; i++)
+    {
+        standbyL* standby = (standbyL*) malloc(sizeof(standbyL));
+        if (read_all(fd, &standby->customer_id, sizeof(int)) != 0)
+        {
+            free(standby);
+            return -1;
+        }
+        standby->next = NULL;
+        *tail = standby;
+        tail = &standby->next;
+        standby_length++;
+    }
+
+    seat_version = header.version;
+    change_floor = header.version;
+    return 0;
+}
+
+/*
+    Replication (see replica.c). The primary reads its changes off the
+    ring and the standby list with seats_standby(); a follower, which
+    serves nothing while it follows, applies them here. A change older
+    than the seat's own version was already in the checkpoint the
+    follower started from and is skipped, so the same change can
+    safely arrive twice.
+ */
+int seats_standby(int* ids, int max, unsigned* generation)
+{
+    standbyL* iter;
+    int count = 0;
+
+    PROF_SEM_WAIT(semaphore, LOCK_STANDBY);
+    for (iter = head; iter != NULL && count < max; iter = iter->next)
+        ids[count++] = iter->customer_id;
+    *generation = standby_generation;
+    PROF_SEM_POST(semaphore, LOCK_STANDBY);
+    return count;
+}
+
+unsigned seats_standby_generation()
+{
+    return __atomic_load_n(&standby_generation, __ATOMIC_RELAXED);
+}
+
+void seats_apply(const seat_change_t* change)
+{
+    seat_t* seat;
+
+    if (change->seat_id < 0 || change->seat_id >= seat_total)
+        return;
+    seat = seat_index[change->seat_id];
+    if (change->version > seat->version)
+    {
+        seat->customer_id = change->customer_id;
+        seat->state = change->state;
+        seat->version = change->version;
+    }
+    // the ring only holds changes made here, after a takeover
+    if (change->version > seat_version)
+        seat_version = change_floor = change->version;
+}
+
+void seats_set_standby(const int* ids, int count)
+{
+    standbyL** tail = &head;
+    int i;
+
+    while (head != NULL)
+    {
+        standbyL* temp = head;
+        head = head->next;
+        free(temp);
+    }
+    for (i = 0; i < count; i++)
+    {
+        standbyL* standby = (standbyL*) malloc(sizeof(standbyL));
+        standby->customer_id = ids[i];
+        standby->next = NULL;
+        *tail = standby;
+        tail = &standby->next;
+    }
+    standby_length = count;
+}
+
 char seat_state_to_char(seat_state_t state)
 {
     switch(state)
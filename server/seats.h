@@ -13,15 +13,55 @@ typedef struct seat_struct
     int id;
     int customer_id;
     seat_state_t state;
+    unsigned long long version; // seat map version of its last change
     struct seat_struct* next;
     pthread_mutex_t* mutex; // new! We added this so we can lock the seats.
 } seat_t;
 
 
+// One entry of the change ring.
+typedef struct seat_change_t
+{
+    unsigned long long version;
+    int seat_id;
+    seat_state_t state;
+    int customer_id;
+} seat_change_t;
+
 void load_seats(int);
 void unload_seats();
 
+// Restart checkpoint, see seats.c. seats_load() is used instead of
+// load_seats(). Both return -1 on a short read or write.
+int seats_save(int fd);
+int seats_load(int fd);
+
+// Replication, see seats.c and replica.c. hook is called after every
+// seat or standby list change, on the thread that made it.
+#define STANDBY_SIZE 8
+void seats_on_change(void (*hook)());
+int seats_standby(int* ids, int max, unsigned* generation);
+unsigned seats_standby_generation();
+void seats_apply(const seat_change_t* change);
+void seats_set_standby(const int* ids, int count);
+
 void list_seats(char* buf, int bufsize);
+int list_seats_range(char* buf, int bufsize, int* next, int end);
+int seat_count();
+
+// Binary seat map: SEAT_MAP_HEADER_SIZE bytes of header (see seats.c)
+// followed by the states packed four seats to a byte, or by the seats
+// changed since a given version.
+#define SEAT_MAP_HEADER_SIZE 16
+#define SEAT_MAP_RECORD_SIZE 4
+unsigned long long seats_version();
+int seat_map_header(unsigned char* buf, int delta, unsigned long long version);
+int seat_map_pack(unsigned char* buf, int bufsize, int* next, int end);
+int seat_map_changes(unsigned char* buf, int bufsize, int* next, int end, unsigned long long since);
+
+// Change feed, see seats.c.
+int seat_change_read(unsigned long long version, seat_change_t* change);
+int seat_events_render(char* buf, int bufsize, unsigned long long* cursor, unsigned long long upto);
 void view_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
 void confirm_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
 void cancel(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
@@ -51,6 +51,22 @@ int sem_wait(m_sem_t *s)
     return 0;
 }
 
+// Decrements the semaphore counter if that
+// doesn't have to wait. Returns -1 if it would.
+int sem_trywait(m_sem_t *s)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&s->mutex);
+    if (s->count > 0)
+    {
+        s->count--;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
 // Broadcasts a signal and increments
 // the semaphore counter.
 int sem_post(m_sem_t *s)
@@ -0,0 +1,37 @@
+#include <stdio.h>
+
+#include "stats.h"
+#include "lockprof.h"
+
+server_stats_t server_stats;
+
+static long get(long* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+int stats_format(char* buf, int size)
+{
+    int len = snprintf(buf, size,
+            "accepted %ld\n"
+            "shed_overload %ld\n"
+            "shed_full %ld\n"
+            "timeouts %ld\n"
+            "arena_overflows %ld\n"
+            "replica_batches %ld\n"
+            "replica_changes %ld\n"
+            "replica_resyncs %ld\n"
+            "replica_lag %ld\n",
+            get(&server_stats.accepted),
+            get(&server_stats.shed_overload),
+            get(&server_stats.shed_full),
+            get(&server_stats.timeouts),
+            get(&server_stats.arena_overflows),
+            get(&server_stats.replica_batches),
+            get(&server_stats.replica_changes),
+            get(&server_stats.replica_resyncs),
+            get(&server_stats.replica_lag));
+    if (len < size)
+        len += lockprof_format(buf + len, size - len);
+    return len < size ? len : size - 1;
+}
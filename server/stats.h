@@ -0,0 +1,29 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+// Server wide counters. Updated with relaxed atomic adds from any
+// thread; a reader sees each counter exactly, but not a consistent
+// snapshot of all of them.
+typedef struct server_stats_t
+{
+    long accepted;      // connections accepted
+    long shed_overload; // turned away with a 503: queue delay over target
+    long shed_full;     // turned away with a 503: queue full
+    long timeouts;      // connections closed by a deadline
+    long arena_overflows; // requests that outgrew the first arena chunk
+    long replica_batches; // batches sent to the follower
+    long replica_changes; // seat changes in them
+    long replica_resyncs; // full seat checkpoints sent to the follower
+    long replica_lag;     // changes the follower has yet to acknowledge
+} server_stats_t;
+
+extern server_stats_t server_stats;
+
+#define STATS_INC(counter) __atomic_fetch_add(&server_stats.counter, 1, __ATOMIC_RELAXED)
+#define STATS_ADD(counter, n) __atomic_fetch_add(&server_stats.counter, (n), __ATOMIC_RELAXED)
+#define STATS_SET(counter, n) __atomic_store_n(&server_stats.counter, (n), __ATOMIC_RELAXED)
+
+// Writes the counters as "name value" lines. Returns the length.
+int stats_format(char* buf, int size);
+
+#endif
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Runs the same trace against each connection front end of the server
+# (-b blocking, epoll, uring) and prints loadgen's numbers for each.
+#
+# usage: bench_backends.sh [tracefile] [threads]   (from testsuite/)
+
+TRACE=${1:-3.trace};
+THREADS=$2;
+PORT=8080;
+
+cd `dirname $0`/.. || exit 1;
+make http_server loadgen > /dev/null || exit 1;
+
+for MODE in blocking epoll uring; do
+	./http_server -b ${MODE} > /tmp/bench_backends.$$.log 2>&1 &
+	PID=$!;
+	sleep 0.5;
+
+	echo "== ${MODE} (`grep -o 'Using .* backend' /tmp/bench_backends.$$.log || echo 'thread per connection'`)";
+	./loadgen localhost ${PORT} testsuite/${TRACE} ${THREADS};
+
+	kill -INT ${PID};
+	sleep 0.3;
+	kill -9 ${PID} 2> /dev/null;
+	wait ${PID} 2> /dev/null;
+done;
+
+rm -f /tmp/bench_backends.$$.log;
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Counts heap allocations per request: runs the server under the
+# malloc_count.so shim, replays a trace with loadgen, and divides the
+# server's allocation count (less the count for an idle start and
+# stop) by the number of requests.
+#
+# usage: count_allocs.sh [tracefile] [server options]   (from testsuite/)
+
+TRACE=${1:-3.trace};
+shift;
+OPTS=$@;
+PORT=8080;
+LOG=/tmp/count_allocs.$$.log;
+
+cd `dirname $0`/.. || exit 1;
+make http_server loadgen malloc_count.so > /dev/null || exit 1;
+
+# allocations of one server run, with or without the trace
+function run()
+{
+	# the previous run's listener may take a moment to go away
+	for try in 1 2 3 4 5; do
+		LD_PRELOAD=./malloc_count.so ./http_server ${OPTS} > ${LOG} 2>&1 &
+		PID=$!;
+		sleep 0.5;
+		grep -q "socket--bind" ${LOG} || break;
+		wait ${PID} 2> /dev/null;
+	done;
+	if [[ "$1" != "" ]]; then
+		./loadgen localhost ${PORT} testsuite/$1 | head -1 > ${LOG}.load;
+	fi;
+	kill -INT ${PID};
+	wait ${PID} 2> /dev/null;
+	grep malloc_count ${LOG} | awk '{ print $3 + $5 + $7 }';
+}
+
+BASE=`run`;
+TOTAL=`run ${TRACE}`;
+REQUESTS=`awk '{ print $2 }' ${LOG}.load`;
+
+echo "server options: ${OPTS:-none}";
+echo "requests ${REQUESTS}  allocations ${TOTAL} (startup ${BASE})";
+awk -v t=${TOTAL} -v b=${BASE} -v r=${REQUESTS} 'BEGIN { printf "allocations per request: %.3f\n", (t - b) / r }';
+
+rm -f ${LOG} ${LOG}.load;
@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Hot standby check: runs a primary (-R) and a follower (-F) on one Unix
+# socket, replays a trace against the primary, kills it, and expects the
+# follower to take over the port with the same seat map and with a
+# booking made before the load still held.
+#
+# usage: replica_test.sh [tracefile] [server options]   (from testsuite/)
+
+TRACE=${1:-3.trace};
+shift;
+OPTS=$@;
+PORT=8080;
+SOCK=/tmp/replica_test.$$.sock;
+LOG=/tmp/replica_test.$$;
+URL=http://localhost:${PORT};
+
+cd `dirname $0`/.. || exit 1;
+make http_server loadgen > /dev/null || exit 1;
+
+./http_server ${OPTS} -R ${SOCK} > ${LOG}.primary 2>&1 &
+PRIMARY=$!;
+sleep 0.3;
+./http_server ${OPTS} -F ${SOCK} > ${LOG}.follower 2>&1 &
+FOLLOWER=$!;
+sleep 0.5;
+
+curl -s "${URL}/view_seat?user=1&seat=15" > /dev/null;
+curl -s "${URL}/confirm?user=1&seat=15" > /dev/null;
+./loadgen localhost ${PORT} testsuite/${TRACE} > ${LOG}.load;
+curl -s "${URL}/stats" | grep replica;
+curl -s "${URL}/list_seats" > ${LOG}.before;
+
+{ kill -9 ${PRIMARY}; wait ${PRIMARY}; } 2> /dev/null;
+# the follower takes over as soon as the port is free
+for try in `seq 50`; do
+	sleep 0.1;
+	grep -q "Took over" ${LOG}.follower && break;
+done;
+
+curl -s "${URL}/list_seats" > ${LOG}.after;
+SEAT=`curl -s "${URL}/view_seat?user=2&seat=15"`;
+kill -INT ${FOLLOWER};
+wait ${FOLLOWER} 2> /dev/null;
+
+cat ${LOG}.load;
+grep -E "Copied|Lost|Took over" ${LOG}.follower;
+if grep -q "failed 0 " ${LOG}.load && [[ -s ${LOG}.before ]] && cmp -s ${LOG}.before ${LOG}.after \
+	&& grep -q "unavailable" <<< "${SEAT}"; then
+	echo "PASS";
+	STATUS=0;
+else
+	echo "FAIL";
+	STATUS=1;
+fi;
+
+rm -f ${SOCK} ${LOG}.primary ${LOG}.follower ${LOG}.load ${LOG}.before ${LOG}.after;
+exit ${STATUS};
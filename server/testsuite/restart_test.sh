@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Graceful restart check: replays a trace with loadgen while the server
+# is restarted (SIGHUP) several times, and expects no failed request and
+# a booking made before the restarts to survive them.
+#
+# usage: restart_test.sh [tracefile] [server options]   (from testsuite/)
+
+TRACE=${1:-3.trace};
+shift;
+OPTS=$@;
+PORT=8080;
+RESTARTS=3;
+LOG=/tmp/restart_test.$$.log;
+URL=http://localhost:${PORT};
+
+cd `dirname $0`/.. || exit 1;
+make http_server loadgen > /dev/null || exit 1;
+
+./http_server ${OPTS} > ${LOG} 2>&1 &
+sleep 0.5;
+
+curl -s "${URL}/view_seat?user=1&seat=15" > /dev/null;
+curl -s "${URL}/confirm?user=1&seat=15" > /dev/null;
+
+./loadgen localhost ${PORT} testsuite/${TRACE} > ${LOG}.load &
+LOADGEN=$!;
+
+for i in `seq ${RESTARTS}`; do
+	sleep 0.3;
+	# the newest, as an earlier run may have left a zombie behind
+	pkill -HUP -n -x http_server;
+	# wait for the hand-over and for the old server to exit
+	for try in `seq 100`; do
+		sleep 0.1;
+		[[ `grep -c 'Handed over' ${LOG}` == ${i} ]] \
+			&& [[ `pgrep -c -r R,S,D -x http_server` == 1 ]] && break;
+	done;
+done;
+
+wait ${LOADGEN};
+SEAT=`curl -s "${URL}/view_seat?user=2&seat=15"`;
+pkill -INT -x http_server;
+sleep 0.3;
+
+cat ${LOG}.load;
+echo "restarts: `grep -c 'Handed over' ${LOG}` of ${RESTARTS}";
+if grep -q "failed 0 " ${LOG}.load && grep -q "unavailable" <<< "${SEAT}" \
+	&& [[ `grep -c 'Handed over' ${LOG}` == ${RESTARTS} ]]; then
+	echo "PASS";
+	STATUS=0;
+else
+	echo "FAIL";
+	STATUS=1;
+fi;
+
+rm -f ${LOG} ${LOG}.load;
+exit ${STATUS};
@@ -2,8 +2,10 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "thread_pool.h"
+#include "lockprof.h"
 
 /**
  *  @struct threadpool_task
@@ -20,29 +22,67 @@
 #define TRUE 1
 #define FALSE 0
 
-// Provided in a original code. Not needed.
-// typedef struct {
-//     void (*function)(void *);
-//     void *argument;
-// } pool_task_t;
+// Elastic pool tuning. A worker is added when a task has waited longer
+// than GROW_WAIT_MS in the queue, at most once every GROW_INTERVAL_MS.
+// A worker retires after IDLE_RETIRE_MS without work, but never within
+// RETIRE_HOLDOFF_MS of the last growth. The gap between the two keeps
+// a burst from adding and dropping the same threads over and over.
+#define GROW_WAIT_MS 5
+#define GROW_INTERVAL_MS 10
+#define IDLE_RETIRE_MS 5000
+#define RETIRE_HOLDOFF_MS 10000
+
+// Admission control, after CoDel: a queue is overloaded once the oldest
+// task has been waiting more than SHED_TARGET_MS continuously for
+// SHED_INTERVAL_MS. A short burst that the workers (or new workers)
+// catch up on never counts; a standing queue does.
+#define SHED_TARGET_MS 50
+#define SHED_INTERVAL_MS 100
+
+// Queue entry. We remember when the task was queued so the pool can
+// tell how long work is waiting for a thread. Connections carry the
+// pool's function; background jobs bring their own and maybe a future.
+typedef struct queue_entry_t {
+  void* (*function)(void *);
+  void* argument;
+  pool_future_t* future;
+  long long enqueued_ms;
+} queue_entryT;
 
 // Pool has been upgraded to have an array of threads, a function handle
 // (since it doesn't make sense to always pass through the function) and
 // a queue, implemented as a circular array.
+//
+// Threads are detached; live_threads counts them so pool_destroy can
+// wait for every one (including ones added later) to exit.
 typedef struct pool_t {
   pthread_mutex_t lock;
   pthread_cond_t notify;
-  pthread_t* threads; // array
-  void* (*function)(void *); // always handle_connection
+  pthread_cond_t not_full; // signalled when a task leaves a full queue
+  pthread_cond_t exited; // signalled when a worker exits
+  pthread_cond_t drained; // signalled when the queue is empty and every worker idle
+  void* (*function)(void *); // what pool_add_task() runs: handle_connection or reactor_work
   int shutdown;
-  int** queue; // circular array of connfds
+  queue_entryT* queue; // circular array of connfds
   int q_start; // circular array start
   int q_end; // circular end
-  int thread_count;
+  int q_count; // start == end for both empty and full, so count too
+  int min_threads;
+  int max_threads;
+  int live_threads;
+  int idle_threads;
+  long long last_grow_ms;
+  long long above_target_ms; // when the queue delay went over SHED_TARGET_MS, 0 if it is under
   int task_queue_size_limit;
 } poolT;
 
 static void *thread_do_work(void *pool);
+static int spawn_thread(poolT *pool);
+static void maybe_grow(poolT *pool, long long now);
+static void enqueue(poolT *pool, void* (*function)(void *), void* argument,
+                    pool_future_t* future);
+static void future_complete(pool_future_t* future, void* result);
+static long long now_ms();
 
 
 /*
@@ -51,104 +91,418 @@ static void *thread_do_work(void *pool);
     Most importantly: creates a pthread array and kicks starts all of them.
  */
 pool_t *pool_create(int queue_size, int num_threads, void* (*function)(void *))
+{
+    return pool_create_elastic(queue_size, num_threads, num_threads, function);
+}
+
+/*
+    Create a threadpool that grows from min_threads up to max_threads
+    with load. A fixed pool is just min_threads == max_threads.
+ */
+pool_t *pool_create_elastic(int queue_size, int min_threads, int max_threads,
+                            void* (*function)(void *))
 {
     poolT* threadpool = (poolT *) malloc(sizeof(poolT));
+    pthread_condattr_t attr;
 
     int i;
-    threadpool->thread_count = num_threads;
-    threadpool->threads = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
+    threadpool->min_threads = min_threads;
+    threadpool->max_threads = max_threads;
+    threadpool->live_threads = 0;
+    threadpool->idle_threads = 0;
+    threadpool->last_grow_ms = now_ms();
+    threadpool->above_target_ms = 0;
 
     threadpool->function = function;
     threadpool->shutdown = FALSE;
 
     threadpool->task_queue_size_limit = queue_size;
-    threadpool->queue = (int **) malloc(sizeof(int *) * queue_size);
+    threadpool->queue = (queue_entryT *) malloc(sizeof(queue_entryT) * queue_size);
     threadpool->q_start = 0;
     threadpool->q_end = 0;
+    threadpool->q_count = 0;
 
-    pthread_mutex_init(&threadpool->lock, NULL);
-    pthread_cond_init(&threadpool->notify, NULL);
+    // idle workers wait with a timeout, so measure it on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
 
-    for(i = 0; i < num_threads; i++)
+    pthread_mutex_init(&threadpool->lock, NULL);
+    pthread_cond_init(&threadpool->notify, &attr);
+    pthread_cond_init(&threadpool->not_full, NULL);
+    pthread_cond_init(&threadpool->exited, NULL);
+    pthread_cond_init(&threadpool->drained, NULL);
+    pthread_condattr_destroy(&attr);
+
+    PROF_LOCK(&threadpool->lock, LOCK_POOL);
+    for(i = 0; i < min_threads; i++)
     {
-        pthread_create(&threadpool->threads[i], NULL, thread_do_work, (void *) threadpool);
+        spawn_thread(threadpool);
     }
+    PROF_UNLOCK(&threadpool->lock, LOCK_POOL);
 
     return threadpool;
 }
 
 /*
-    Adds a task to the threadpool.
+    Adds a task to the threadpool. Waits for room if the queue is full.
  */
 int pool_add_task(pool_t *pool, void* argument)
 {
-    pthread_mutex_lock(&pool->lock);
+    PROF_LOCK(&pool->lock, LOCK_POOL);
 
-    pool->queue[pool->q_end] = argument;
-    pool->q_end = (pool->q_end + 1) % pool->task_queue_size_limit;
+    while (pool->q_count == pool->task_queue_size_limit && pool->shutdown == FALSE)
+    {
+        PROF_COND_WAIT(&pool->not_full, &pool->lock, LOCK_POOL);
+    }
+    if (pool->shutdown == TRUE)
+    {
+        PROF_UNLOCK(&pool->lock, LOCK_POOL);
+        return -1;
+    }
 
-    pthread_cond_signal(&pool->notify);
-    pthread_mutex_unlock(&pool->lock);
+    enqueue(pool, pool->function, argument, NULL);
+    PROF_UNLOCK(&pool->lock, LOCK_POOL);
+    return 0;
+}
+
+/*
+    Adds a task only if there is room for it right now.
+ */
+int pool_try_add_task(pool_t *pool, void* argument)
+{
+    PROF_LOCK(&pool->lock, LOCK_POOL);
+
+    if (pool->q_count == pool->task_queue_size_limit || pool->shutdown == TRUE)
+    {
+        PROF_UNLOCK(&pool->lock, LOCK_POOL);
+        return -1;
+    }
+
+    enqueue(pool, pool->function, argument, NULL);
+    PROF_UNLOCK(&pool->lock, LOCK_POOL);
     return 0;
 }
 
+/*
+    Queues a task with its own function, e.g. a background job.
+ */
+int pool_submit(pool_t *pool, void* (*function)(void *), void* argument, pool_future_t* future)
+{
+    pool_task_t task = { function, argument, future };
+
+    return pool_submit_batch(pool, &task, 1) == 1 ? 0 : -1;
+}
+
+/*
+    Queues many tasks at once. The lock is only let go while waiting
+    for room in a full queue.
+ */
+int pool_submit_batch(pool_t *pool, pool_task_t* tasks, int count)
+{
+    int i;
+
+    PROF_LOCK(&pool->lock, LOCK_POOL);
+    for (i = 0; i < count; i++)
+    {
+        while (pool->q_count == pool->task_queue_size_limit && pool->shutdown == FALSE)
+        {
+            PROF_COND_WAIT(&pool->not_full, &pool->lock, LOCK_POOL);
+        }
+        if (pool->shutdown == TRUE)
+            break;
+        enqueue(pool, tasks[i].function, tasks[i].argument, tasks[i].future);
+    }
+    PROF_UNLOCK(&pool->lock, LOCK_POOL);
+    return i;
+}
+
+/*
+    Admission check for new work, see SHED_TARGET_MS. The delay is the
+    age of the task at the head of the queue, so a queue that workers
+    have stopped draining counts too.
+ */
+int pool_overloaded(pool_t *pool)
+{
+    int overloaded = FALSE;
+
+    PROF_LOCK(&pool->lock, LOCK_POOL);
+    long long now = now_ms();
+    long long delay = pool->q_count > 0 ? now - pool->queue[pool->q_start].enqueued_ms : 0;
+
+    if (delay < SHED_TARGET_MS)
+        pool->above_target_ms = 0;
+    else if (pool->above_target_ms == 0)
+        pool->above_target_ms = now;
+    else if (now - pool->above_target_ms >= SHED_INTERVAL_MS)
+        overloaded = TRUE;
+    PROF_UNLOCK(&pool->lock, LOCK_POOL);
+
+    return overloaded;
+}
+
+/*
+    Waits until every queued task has run and every worker is idle.
+    Whoever queues tasks must have stopped, or this may never return.
+ */
+void pool_drain(pool_t *pool)
+{
+    PROF_LOCK(&pool->lock, LOCK_POOL);
+    while (pool->q_count > 0 || pool->idle_threads < pool->live_threads)
+    {
+        PROF_COND_WAIT(&pool->drained, &pool->lock, LOCK_POOL);
+    }
+    PROF_UNLOCK(&pool->lock, LOCK_POOL);
+}
+
 /*
     Destroy the threadpool, free all memory, destroy treads, etc.
+    Tasks already queued still run first; new ones are refused.
  */
 int pool_destroy(pool_t *pool)
 {
+    PROF_LOCK(&pool->lock, LOCK_POOL);
     pool->shutdown = TRUE;
-
-    int i;
     pthread_cond_broadcast(&pool->notify);
+    pthread_cond_broadcast(&pool->not_full);
 
-    for(i = 0; i < pool->thread_count; i++)
+    while (pool->live_threads > 0)
     {
-        pthread_join(pool->threads[i], NULL);
+        PROF_COND_WAIT(&pool->exited, &pool->lock, LOCK_POOL);
     }
+    PROF_UNLOCK(&pool->lock, LOCK_POOL);
 
     pthread_mutex_destroy(&pool->lock);
     pthread_cond_destroy(&pool->notify);
-    free(pool->threads);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->exited);
+    pthread_cond_destroy(&pool->drained);
     free(pool->queue);
     free(pool);
 
     return 0;
 }
 
+/*
+    Starts one more worker. Must be called with the pool lock held.
+ */
+static int spawn_thread(poolT *pool)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int rc;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, thread_do_work, (void *) pool);
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0)
+        return -1;
+
+    pool->live_threads++;
+    return 0;
+}
+
+/*
+    Puts a task on the queue, which must have room, and wakes a worker.
+    Must be called with the pool lock held.
+ */
+static void enqueue(poolT *pool, void* (*function)(void *), void* argument,
+                    pool_future_t* future)
+{
+    long long now = now_ms();
+    pool->queue[pool->q_end].function = function;
+    pool->queue[pool->q_end].argument = argument;
+    pool->queue[pool->q_end].future = future;
+    pool->queue[pool->q_end].enqueued_ms = now;
+    pool->q_end = (pool->q_end + 1) % pool->task_queue_size_limit;
+    pool->q_count++;
+
+    // if nobody is free to take it, check whether the queue is backing up
+    if (pool->idle_threads == 0)
+        maybe_grow(pool, now);
+
+    pthread_cond_signal(&pool->notify);
+}
+
+/*
+    Adds a worker if the task at the head of the queue has waited longer
+    than GROW_WAIT_MS. Growth is rate limited so a single burst adds
+    threads one at a time. Must be called with the pool lock held.
+ */
+static void maybe_grow(poolT *pool, long long now)
+{
+    if (pool->live_threads >= pool->max_threads)
+        return;
+    if (pool->q_count == 0)
+        return;
+    if (now - pool->queue[pool->q_start].enqueued_ms < GROW_WAIT_MS)
+        return;
+    if (now - pool->last_grow_ms < GROW_INTERVAL_MS)
+        return;
+
+    if (spawn_thread(pool) == 0)
+        pool->last_grow_ms = now;
+}
+
 /*
     Work loop for threads. This is passed into pthread_create.
 
     The data passed in is the threadpool itself, which contains all
     of the needed data.
+
+    The task itself runs without the pool lock held, otherwise only one
+    connection could be served at a time.
  */
 static void *thread_do_work(void *pool)
 {
     poolT* threadpool = (poolT *) pool;
+    struct timespec deadline;
 
+    PROF_LOCK(&threadpool->lock, LOCK_POOL);
     while (1)
     {
-        pthread_mutex_lock(&threadpool->lock);
-
         // checks the queue is empty and no shutdown command has been issued
-        while ((threadpool->q_start == threadpool->q_end) && (threadpool->shutdown == FALSE)) {
-            pthread_cond_wait(&threadpool->notify, &threadpool->lock);
+        int retire = FALSE;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += IDLE_RETIRE_MS / 1000;
+        deadline.tv_nsec += (IDLE_RETIRE_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
 
-        // shutdown if threads if command issued, since we need to destroy everything
-        if (threadpool->shutdown == TRUE)
-            break;
-
-        if (threadpool->q_start != threadpool->q_end)
-        {
-            int* argument = threadpool->queue[threadpool->q_start];
-            threadpool->q_start = (threadpool->q_start + 1) % threadpool->task_queue_size_limit;
-            threadpool->function(argument);
+        threadpool->idle_threads++;
+        if (threadpool->q_count == 0 && threadpool->idle_threads == threadpool->live_threads)
+            pthread_cond_broadcast(&threadpool->drained);
+        while ((threadpool->q_count == 0) && (threadpool->shutdown == FALSE)) {
+            if (PROF_COND_TIMEDWAIT(&threadpool->notify, &threadpool->lock, &deadline, LOCK_POOL) != 0)
+            {
+                // idle for IDLE_RETIRE_MS; leave if the pool can spare us
+                // and has not just grown
+                if (threadpool->q_count == 0
+                    && threadpool->live_threads > threadpool->min_threads
+                    && now_ms() - threadpool->last_grow_ms >= RETIRE_HOLDOFF_MS)
+                {
+                    retire = TRUE;
+                    break;
+                }
+                deadline.tv_sec += IDLE_RETIRE_MS / 1000;
+            }
         }
+        threadpool->idle_threads--;
+
+        // on shutdown, leave only once the queue is empty, so every queued
+        // task runs and every future it carries completes
+        if (retire || (threadpool->shutdown == TRUE && threadpool->q_count == 0))
+            break;
 
-        pthread_mutex_unlock(&threadpool->lock);
+        long long now = now_ms();
+        queue_entryT task = threadpool->queue[threadpool->q_start];
+        threadpool->q_start = (threadpool->q_start + 1) % threadpool->task_queue_size_limit;
+        threadpool->q_count--;
+        pthread_cond_signal(&threadpool->not_full);
+
+        // this task waited too long, so the queue may still be backing up
+        if (now - task.enqueued_ms >= GROW_WAIT_MS)
+            maybe_grow(threadpool, now);
+
+        PROF_UNLOCK(&threadpool->lock, LOCK_POOL);
+        void* result = task.function(task.argument);
+        if (task.future != NULL)
+            future_complete(task.future, result);
+        PROF_LOCK(&threadpool->lock, LOCK_POOL);
     }
 
+    threadpool->live_threads--;
+    pthread_cond_signal(&threadpool->exited);
+    pthread_cond_broadcast(&threadpool->drained);
+    PROF_UNLOCK(&threadpool->lock, LOCK_POOL);
+
     pthread_exit(NULL);
     return(NULL);
 }
+
+/*
+    Current time on the monotonic clock, in milliseconds.
+ */
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void pool_future_init(pool_future_t* future)
+{
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->done_cond, NULL);
+    future->done = FALSE;
+    future->result = NULL;
+    future->callback = NULL;
+    future->callback_arg = NULL;
+}
+
+void pool_future_destroy(pool_future_t* future)
+{
+    pthread_mutex_destroy(&future->lock);
+    pthread_cond_destroy(&future->done_cond);
+}
+
+void* pool_future_wait(pool_future_t* future)
+{
+    void* result;
+
+    pthread_mutex_lock(&future->lock);
+    while (!future->done)
+        pthread_cond_wait(&future->done_cond, &future->lock);
+    result = future->result;
+    pthread_mutex_unlock(&future->lock);
+    return result;
+}
+
+int pool_future_done(pool_future_t* future)
+{
+    int done;
+
+    pthread_mutex_lock(&future->lock);
+    done = future->done;
+    pthread_mutex_unlock(&future->lock);
+    return done;
+}
+
+void pool_future_then(pool_future_t* future, void (*callback)(pool_future_t*, void*), void* arg)
+{
+    pthread_mutex_lock(&future->lock);
+    if (!future->done)
+    {
+        future->callback = callback;
+        future->callback_arg = arg;
+        pthread_mutex_unlock(&future->lock);
+        return;
+    }
+    pthread_mutex_unlock(&future->lock);
+    callback(future, arg);
+}
+
+/*
+    Publishes a task's result. The callback runs after the future is
+    unlocked and is the last use of it here, so it may free the future.
+ */
+static void future_complete(pool_future_t* future, void* result)
+{
+    void (*callback)(pool_future_t*, void*);
+    void* arg;
+
+    pthread_mutex_lock(&future->lock);
+    future->result = result;
+    future->done = TRUE;
+    callback = future->callback;
+    arg = future->callback_arg;
+    pthread_cond_broadcast(&future->done_cond);
+    pthread_mutex_unlock(&future->lock);
+
+    if (callback != NULL)
+        callback(future, arg);
+}
@@ -1,13 +1,84 @@
 #ifndef _THREADPOOL_H_
 #define _THREADPOOL_H_
 
+#include <pthread.h>
+
 typedef struct pool_t pool_t;
 
+// Completion handle for a submitted task. The submitter owns it (it can
+// live on the stack or inside the job's own state) and must keep it
+// until pool_future_wait() has returned, or until the callback has run
+// if it set one.
+typedef struct pool_future_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+    void* result; // what the task's function returned
+    void (*callback)(struct pool_future_t* future, void* arg);
+    void* callback_arg;
+} pool_future_t;
+
+// One task for pool_submit_batch(). future may be NULL.
+typedef struct pool_task_t
+{
+    void* (*function)(void *);
+    void* argument;
+    pool_future_t* future;
+} pool_task_t;
+
+// routine is what pool_add_task() runs; it may be NULL for a pool that
+// only takes pool_submit() tasks.
+pool_t *pool_create(int queue_size, int thread_count, void* (*routine)(void *));
 
-pool_t *pool_create(int thread_count, int queue_size, void* (*routine)(void *));
+// Elastic pool: starts with min_threads workers and adds workers (up to
+// max_threads) when tasks sit in the queue too long. Workers that stay
+// idle long enough are retired again, down to min_threads.
+pool_t *pool_create_elastic(int queue_size, int min_threads, int max_threads,
+                            void* (*routine)(void *));
 
+// Queues arg for the pool's routine. Waits for room if the queue is full.
 int pool_add_task(pool_t *pool, void* arg);
 
+// Like pool_add_task, but returns -1 instead of waiting when the queue
+// is full.
+int pool_try_add_task(pool_t *pool, void* arg);
+
+// Returns 1 when tasks have been waiting in the queue too long for too
+// long (a standing queue, not a burst), meaning new work should be
+// turned away.
+int pool_overloaded(pool_t *pool);
+
+// Queues function(arg) on any worker, for background jobs. When future
+// is not NULL it is completed with the function's result. Waits for
+// room like pool_add_task(). Returns -1 if the pool is shutting down.
+int pool_submit(pool_t *pool, void* (*function)(void *), void* arg, pool_future_t* future);
+
+// Queues count tasks under one acquisition of the pool lock, waiting
+// for room as needed. Returns how many were queued, fewer than count
+// only if the pool shut down.
+int pool_submit_batch(pool_t *pool, pool_task_t* tasks, int count);
+
+// Waits until the queue is empty and no task is running. Nothing may
+// be added meanwhile.
+void pool_drain(pool_t *pool);
+
+// Refuses new tasks, runs the ones already queued, then stops the
+// workers and frees the pool.
 int pool_destroy(pool_t *pool);
 
+void pool_future_init(pool_future_t* future);
+void pool_future_destroy(pool_future_t* future);
+
+// Waits for the task and returns its result.
+void* pool_future_wait(pool_future_t* future);
+
+// Returns 1 if the task has finished.
+int pool_future_done(pool_future_t* future);
+
+// Runs callback(future, arg) once the task has finished: on the worker
+// that ran it, or right away on the caller if it already has. At most
+// one callback per future.
+void pool_future_then(pool_future_t* future, void (*callback)(pool_future_t*, void*), void* arg);
+
 #endif
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+/*
+                   TIMER WHEEL
+
+Hashed timing wheel for connection deadlines. A timer goes in the slot
+for the tick it expires on, in an intrusive doubly linked list, so
+arming, re-arming and disarming are O(1) however many timers there
+are. Expiring walks one slot per elapsed tick; a slot holds only the
+timers for that tick unless a deadline is more than a whole turn of
+the wheel away, in which case the timer stays in its slot and is
+skipped until its turn comes around.
+
+Deadlines are rounded up to the next tick, so a timer fires between 0
+and WHEEL_TICK_MS late, never early.
+
+*/
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(timer_wheel_t* wheel, long long now_ms)
+{
+    int i;
+
+    for (i = 0; i < WHEEL_SLOTS; i++)
+    {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    wheel->tick = now_ms / WHEEL_TICK_MS;
+    wheel->count = 0;
+}
+
+void wheel_timer_init(wheel_timer_t* timer, void* data)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->data = data;
+}
+
+void wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, long long expires_ms)
+{
+    long long tick = (expires_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    wheel_timer_t* head;
+
+    wheel_remove(wheel, timer);
+
+    // a tick that has already been processed is handled on the next one
+    if (tick < wheel->tick)
+        tick = wheel->tick;
+    head = &wheel->slots[tick & SLOT_MASK];
+
+    timer->expires = expires_ms;
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->count++;
+}
+
+void wheel_remove(timer_wheel_t* wheel, wheel_timer_t* timer)
+{
+    if (timer->prev == NULL)
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+int wheel_expire(timer_wheel_t* wheel, long long now_ms, void (*expired)(wheel_timer_t*))
+{
+    long long now_tick = now_ms / WHEEL_TICK_MS;
+    int fired = 0;
+    int steps = 0;
+
+    while (wheel->tick <= now_tick && wheel->count > 0)
+    {
+        wheel_timer_t* head = &wheel->slots[wheel->tick & SLOT_MASK];
+        wheel_timer_t due;
+        wheel_timer_t* timer;
+
+        // Move what is due to a private list first; the callbacks may
+        // add timers to this very slot.
+        due.next = &due;
+        due.prev = &due;
+        timer = head->next;
+        while (timer != head)
+        {
+            wheel_timer_t* next = timer->next;
+            if (timer->expires <= now_ms)
+            {
+                timer->prev->next = timer->next;
+                timer->next->prev = timer->prev;
+                timer->next = &due;
+                timer->prev = due.prev;
+                due.prev->next = timer;
+                due.prev = timer;
+            }
+            timer = next;
+        }
+
+        while (due.next != &due)
+        {
+            timer = due.next;
+            due.next = timer->next;
+            timer->next->prev = &due;
+            timer->next = NULL;
+            timer->prev = NULL;
+            wheel->count--;
+            fired++;
+            expired(timer);
+        }
+
+        wheel->tick++;
+
+        // after a long sleep every slot has been looked at once
+        if (++steps == WHEEL_SLOTS)
+            wheel->tick = now_tick + 1;
+    }
+
+    if (wheel->tick <= now_tick)
+        wheel->tick = now_tick + 1;
+    return fired;
+}
+
+int wheel_fire_all(timer_wheel_t* wheel, void (*fired)(wheel_timer_t*))
+{
+    wheel_timer_t all;
+    wheel_timer_t* timer;
+    int count = 0;
+    int i;
+
+    // collect first, the callbacks may arm timers again
+    all.next = &all;
+    all.prev = &all;
+    for (i = 0; i < WHEEL_SLOTS; i++)
+    {
+        wheel_timer_t* head = &wheel->slots[i];
+        if (head->next == head)
+            continue;
+        head->next->prev = all.prev;
+        all.prev->next = head->next;
+        head->prev->next = &all;
+        all.prev = head->prev;
+        head->next = head;
+        head->prev = head;
+    }
+
+    while (all.next != &all)
+    {
+        timer = all.next;
+        all.next = timer->next;
+        timer->next->prev = &all;
+        timer->next = NULL;
+        timer->prev = NULL;
+        wheel->count--;
+        count++;
+        fired(timer);
+    }
+    return count;
+}
+
+int wheel_timeout(timer_wheel_t* wheel, long long now_ms)
+{
+    long long wait;
+
+    if (wheel->count == 0)
+        return -1;
+    wait = wheel->tick * WHEEL_TICK_MS - now_ms;
+    return wait > 0 ? (int) wait : 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#define WHEEL_TICK_MS 100
+#define WHEEL_SLOTS 1024 // power of two; one turn of the wheel is ~100 s
+
+// A timer lives inside the object it belongs to, so arming one never
+// allocates. Not armed while prev is NULL.
+typedef struct wheel_timer_t
+{
+    struct wheel_timer_t* next;
+    struct wheel_timer_t* prev;
+    long long expires; // ms
+    void* data;
+} wheel_timer_t;
+
+typedef struct timer_wheel_t
+{
+    wheel_timer_t slots[WHEEL_SLOTS]; // list heads
+    long long tick;                   // next tick to be processed
+    int count;                        // armed timers
+} timer_wheel_t;
+
+void wheel_init(timer_wheel_t* wheel, long long now_ms);
+
+// Initializes a timer as not armed.
+void wheel_timer_init(wheel_timer_t* timer, void* data);
+
+// Arms timer to fire at expires_ms, re-arming it if it already was.
+void wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, long long expires_ms);
+
+// Disarms timer. Harmless if it isn't armed.
+void wheel_remove(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+// Fires every timer due at now_ms. Each is disarmed before its
+// callback runs, and the callback may arm or disarm any timer.
+// Returns how many fired.
+int wheel_expire(timer_wheel_t* wheel, long long now_ms, void (*expired)(wheel_timer_t*));
+
+// Fires every armed timer now, whatever its deadline; a callback can
+// tell from timer->expires whether it was due. Returns how many fired.
+int wheel_fire_all(timer_wheel_t* wheel, void (*fired)(wheel_timer_t*));
+
+// How long the caller may sleep before the next wheel_expire(),
+// or -1 when no timer is armed.
+int wheel_timeout(timer_wheel_t* wheel, long long now_ms);
+
+#endif
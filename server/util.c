@@ -3,239 +3,511 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
 
 
 #include "seats.h"
-
-#define BUFSIZE 1024
+#include "request.h"
+#include "response.h"
+#include "conn.h"
+#include "stats.h"
+#include "arena.h"
+#include "util.h"
 
 int writenbytes(int,char *,int);
-int readnbytes(int,char *,int);
-int get_line(int, char*,int);
-
-int parse_int_arg(char* filename, char* arg);
+int read_request(int, char*, int, int);
 
-void handle_connection(int* connfd_ptr)
+// Paths the server answers itself; anything else is looked up as a file.
+enum
 {
-    int connfd = *(connfd_ptr);
-    free(connfd_ptr); // frees the connfd ptr we allocated earlier!
+    ROUTE_LIST_SEATS,
+    ROUTE_VIEW_SEAT,
+    ROUTE_CONFIRM,
+    ROUTE_CANCEL,
+    ROUTE_STATS,
+    ROUTE_SEAT_EVENTS,
+    NUM_ROUTES
+};
 
-    int fd;
-    char buf[BUFSIZE+1];
-    char instr[20];
-    char file[100];
-    char type[20];
+static const char* const route_names[NUM_ROUTES] =
+{
+    "list_seats",
+    "view_seat",
+    "confirm",
+    "cancel",
+    "stats",
+    "seat_events"
+};
 
-    int i=0;
-    int j=0;
+static route_table_t routes;
 
-    char *ok_response = "HTTP/1.0 200 OK\r\n"\
-                           "Content-type: text/html\r\n\r\n";
+// Builds the route table and the response header blocks. Called once
+// from main before any connection is handled.
+void init_handlers()
+{
+    init_responses();
 
-    char *notok_response = "HTTP/1.0 404 FILE NOT FOUND\r\n"\
-                            "Content-type: text/html\r\n\r\n"\
-                            "<html><body bgColor=white text=black>\n"\
-                            "<h2>404 FILE NOT FOUND</h2>\n"\
-                            "</body></html>\n";
+    if (route_table_build(&routes, route_names, NUM_ROUTES) != 0)
+    {
+        fprintf(stderr, "Unable to build route table\n");
+        exit(-1);
+    }
+}
 
-    char *bad_request = "HTTP/1.0 400 BAD REQUEST\r\n"\
-                              "Content-type: text/html\r\n\r\n"\
-                              "<html><body><h2>BAD REQUEST</h2>"\
-                              "</body></html>\n";
-                              
+// Blocking mode: the worker reads the request, builds the response and
+// writes it out itself. The descriptor is passed in the task pointer.
+void* handle_connection(void* fd)
+{
+    int connfd = (int) (intptr_t) fd;
 
-    // first read loop -- get request and headers
+    conn_t conn;
+    conn.fd = connfd;
+    conn.keep_alive = 0; // an idle connection would hold this worker
+    conn.subscriber = 0;
 
-    // parse request to get file name
-    // Assumption: this is a GET request and filename contains no spaces
-    // parse request
-    // get headers
+    // a reader that stops draining the socket fails the write
+    struct timeval send_timeout = { SEND_TIMEOUT_MS / 1000, (SEND_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
 
-    //Expection Format: 'GET filenane.txt HTTP/1.X'
-    
-    get_line(connfd, buf, BUFSIZE);
-    
-    //parse out instruction
-    while( !isspace(buf[j]) && (i < sizeof(instr) - 1))
+    // Read the request line and headers
+    conn.header_len = read_request(connfd, conn.in, CONN_INBUF, HEADER_TIMEOUT_MS);
+    conn.in_len = conn.header_len;
+    if (conn.header_len == 0)
     {
-        instr[i] = buf[i];
-        i++;
-        j++;
+        // timed out or went away without sending a request
+        close(connfd);
+        return NULL;
     }
-    j+=2;
-    instr[i] = '\0';
 
+    serve_request(&conn);
 
-    //Only accept GET requests
-    if (strncmp(instr, "GET", 3) != 0) {
-        writenbytes(connfd, bad_request, strlen(bad_request));
-        close(connfd);
-        return;
+    if (response_send(connfd, &conn.response) >= 0)
+    {
+        // send the rest of the file
+        int ret;
+        while (conn.file_left > 0 && (ret = read(conn.file_fd, conn.out, CONN_WINDOW)) > 0) {
+            if (writenbytes(connfd, conn.out, ret) < 0)
+                break;
+            conn.file_left -= ret;
+        }
+
+        // or of a generated body
+        while (next_window(&conn) && response_send(connfd, &conn.response) >= 0)
+            ;
     }
 
-    //parse out filename
-    i=0;
-    while (!isspace(buf[j]) && (i < sizeof(file) - 1))
+    // close file and free space
+    if (conn.file_fd != -1)
+        close(conn.file_fd);
+    close(connfd);
+    arena_reset(worker_arena());
+    return NULL;
+}
+
+// Blocking mode admission control: answers a connection the pool has
+// no room for with the canned 503 and closes it, without a worker.
+// Whatever part of the request has already arrived is read first;
+// closing with unread data would reset the connection and could
+// destroy the 503 before the client reads it.
+void shed_connection(int connfd)
+{
+    char discard[CONN_INBUF];
+    response_t res;
+
+    while (recv(connfd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+
+    response_error(&res, STATUS_UNAVAILABLE);
+    send(connfd, res.iov[0].iov_base, res.iov[0].iov_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(connfd);
+}
+
+// Seat list body: one window of seats per call.
+static int produce_seat_list(conn_t* conn, char* buf, int size)
+{
+    return list_seats_range(buf, size, &conn->stream_pos, conn->stream_end);
+}
+
+// Sends the first len bytes already in conn->out as the first window
+// of a generated body. HTTP/1.1 clients get chunks (and can keep the
+// connection); HTTP/1.0 clients get a body that ends when the
+// connection closes.
+static void start_stream(conn_t* conn, content_type_t type, int len)
+{
+    int more = conn->stream_pos < conn->stream_end;
+
+    if (!more)
+        conn->produce = NULL;
+    conn->chunked = slice_eq(conn->request->version, "HTTP/1.1");
+
+    if (conn->chunked)
+    {
+        response_start_chunked(&conn->response, type, conn->keep_alive);
+        response_chunk(&conn->response, conn->out, len, !more);
+    }
+    else
     {
-        file[i] = buf[j];
-        i++;
-        j++;
+        conn->keep_alive = 0;
+        response_start_unsized(&conn->response, type, conn->out, len);
     }
-    j++;
-    file[i] = '\0';
+}
+
+// list_seats streams the seat map a window at a time, so a venue of any
+// size lists in CONN_WINDOW bytes. from= and count= select a range of
+// seat ids.
+static void start_seat_list(conn_t* conn)
+{
+    http_request_t* request = conn->request;
+    long long from = request_int_param(request, "from");
+    long long end = seat_count();
+
+    if (from < 0)
+        from = 0;
+    if (from > seat_count())
+        from = seat_count();
+
+    // a count of 0 (or one that isn't a number) lists nothing
+    if (request_param(request, "count").len > 0)
+        end = from + request_int_param(request, "count");
+    if (end > seat_count())
+        end = seat_count();
+    if (end < from)
+        end = from;
+
+    conn->produce = produce_seat_list;
+    conn->stream_pos = from;
+    conn->stream_end = end;
+    start_stream(conn, TYPE_HTML, produce_seat_list(conn, conn->out, CONN_WINDOW));
+}
+
+// Binary seat map bodies.
+static int produce_seat_map(conn_t* conn, char* buf, int size)
+{
+    return seat_map_pack((unsigned char*) buf, size, &conn->stream_pos, conn->stream_end);
+}
+
+static int produce_seat_changes(conn_t* conn, char* buf, int size)
+{
+    return seat_map_changes((unsigned char*) buf, size, &conn->stream_pos, conn->stream_end,
+                            conn->stream_since);
+}
+
+// The binary seat map (see seats.c), asked for with ?format=binary or
+// an Accept header naming SEAT_MAP_TYPE. With since=V only the seats
+// changed after version V are sent, unless that list could be larger
+// than the whole map.
+// A seat map version from a request. Saturates rather than wrapping
+// around to an old version, so a version too big reads as a future one.
+static unsigned long long parse_version(slice_t value)
+{
+    unsigned long long result = 0;
+    int i;
 
-    //parse out type
-    i=0;
-    while (!isspace(buf[j]) && (buf[j] != '\0') && (i < sizeof(type) - 1))
+    for (i = 0; i < value.len && value.ptr[i] >= '0' && value.ptr[i] <= '9'; i++)
     {
-        type[i] = buf[j];
-        i++;
-        j++;
+        unsigned digit = value.ptr[i] - '0';
+
+        if (result > (ULLONG_MAX - digit) / 10)
+            return ULLONG_MAX;
+        result = result * 10 + digit;
     }
-    type[i] = '\0';
+    return result;
+}
 
-    while (get_line(connfd, buf, BUFSIZE) > 0)
+static void start_seat_map(conn_t* conn)
+{
+    http_request_t* request = conn->request;
+    unsigned long long version = seats_version();
+    unsigned long long since = 0;
+    int delta = 0;
+    int len;
+
+    if (request_param(request, "since").len > 0)
     {
-        //ignore headers -> (for now)
+        since = parse_version(request_param(request, "since"));
+
+        // at most one changed seat per version since then
+        delta = since <= version
+                && (version - since) * SEAT_MAP_RECORD_SIZE < (unsigned long long) (seat_count() + 3) / 4;
     }
 
-    int length;
-    for(i = 0; i < strlen(file); i++)
+    conn->produce = delta ? produce_seat_changes : produce_seat_map;
+    conn->stream_pos = 0;
+    conn->stream_end = seat_count();
+    conn->stream_since = since;
+
+    len = seat_map_header((unsigned char*) conn->out, delta, version);
+    len += conn->produce(conn, conn->out + len, CONN_WINDOW - len);
+    start_stream(conn, TYPE_SEAT_MAP, len);
+}
+
+// Seat change feed, as server-sent events. The client picks up after
+// the change in since= or in the Last-Event-ID header its EventSource
+// sends when reconnecting, or else from now. Subscribers in the event
+// driven modes are held open and sent changes as they happen (see
+// reactor.c); in blocking mode, where that would hold a worker, the
+// changes so far are sent and the connection closed, which makes it a
+// poll.
+static void start_seat_events(conn_t* conn, int subscribe)
+{
+    http_request_t* request = conn->request;
+    slice_t since = request_param(request, "since");
+    unsigned long long version = seats_version();
+    unsigned long long cursor = 0;
+    int len;
+
+    if (since.len == 0)
+        since = request_header(request, "Last-Event-ID");
+    if (since.len == 0)
+        cursor = version;
+    else
+        cursor = parse_version(since);
+    if (cursor > version)
+        cursor = version;
+
+    len = seat_events_render(conn->out, CONN_WINDOW, &cursor, version);
+    conn->stream_since = cursor;
+    conn->subscriber = subscribe;
+    conn->keep_alive = 0;
+    response_start_unsized(&conn->response, TYPE_EVENT_STREAM, conn->out, len);
+}
+
+// Whether a list_seats request wants the binary seat map.
+static int wants_seat_map(http_request_t* request)
+{
+    slice_t format = request_param(request, "format");
+    slice_t accept = request_header(request, "Accept");
+    int n = strlen(SEAT_MAP_TYPE);
+    int i;
+
+    if (format.len > 0)
+        return slice_eq(format, "binary");
+    for (i = 0; i + n <= accept.len; i++)
     {
-        if(file[i] == '?')
-            break;
+        if (strncasecmp(accept.ptr + i, SEAT_MAP_TYPE, n) == 0)
+            return 1;
     }
-    length = i;
-    
-    char resource[length+1];
+    return 0;
+}
+
+// Renders the next window of a generated body into conn->out and makes
+// it the response. Returns 0 if there is nothing left to send.
+int next_window(conn_t* conn)
+{
+    int len, more;
+
+    if (conn->produce == NULL)
+        return 0;
 
-    if (length > strlen(file)) {
-      length = strlen(file);
+    len = conn->produce(conn, conn->out, CONN_WINDOW);
+    more = conn->stream_pos < conn->stream_end;
+    if (!more)
+        conn->produce = NULL;
+
+    if (conn->chunked)
+    {
+        response_reset(&conn->response);
+        response_chunk(&conn->response, conn->out, len, !more);
     }
+    else
+        response_continue(&conn->response, conn->out, len);
+    return 1;
+}
 
-    strncpy(resource, file, length);
-    resource[length] = 0;
-    
-    int seat_id = parse_int_arg(file, "seat=");
-    int user_id = parse_int_arg(file, "user=");
-    int customer_priority = parse_int_arg(file, "priority=");
-    
-    // Check if the request is for one of our operations
-    if (strncmp(resource, "list_seats", length) == 0)
-    {  
-        list_seats(buf, BUFSIZE);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
-    } 
-    else if(strncmp(resource, "view_seat", length) == 0)
+// Builds the response for the request headers in conn->in (header_len
+// bytes; 0 or less if they could not be read). Small bodies are written
+// into conn->out. For a file, the first window is read into conn->out
+// and the file is left open in conn->file_fd with file_left bytes still
+// to send, at file_offset. conn->keep_alive stays set only if it was set
+// on entry and the client asked for "Connection: keep-alive".
+//
+// The parsed request and everything else only needed while building the
+// response come from the worker's arena; the caller resets it once the
+// response no longer refers to them.
+void serve_request(conn_t* conn)
+{
+    arena_t* arena = worker_arena();
+    http_request_t* request;
+    char* resource;
+    struct stat st;
+    int fd;
+    int allow_keep_alive = conn->keep_alive;
+    int allow_subscribe = conn->subscriber;
+
+    conn->file_fd = -1;
+    conn->file_offset = 0;
+    conn->file_left = 0;
+    conn->produce = NULL;
+    conn->subscriber = 0;
+    conn->keep_alive = 0; // error responses close the connection
+
+    conn->request = request = arena == NULL ? NULL
+        : (http_request_t*) arena_alloc(arena, sizeof(http_request_t));
+    if (request == NULL)
     {
-        view_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
-    } 
-    else if(strncmp(resource, "confirm", length) == 0)
+        response_error(&conn->response, STATUS_UNAVAILABLE);
+        return;
+    }
+
+    // Parse the request in one pass. The parsed request points into conn->in.
+    //Only accept GET requests
+    if (conn->header_len <= 0
+        || http_parse_request(conn->in, conn->header_len, request) != 0
+        || !slice_eq(request->method, "GET"))
     {
-        confirm_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
+        response_error(&conn->response, STATUS_BAD_REQUEST);
+        return;
     }
-    else if(strncmp(resource, "cancel", length) == 0)
+
+    if (allow_keep_alive && slice_case_eq(request_header(request, "Connection"), "keep-alive"))
+        conn->keep_alive = 1;
+
+    // routes and files are named without the leading '/'
+    slice_t path = request->path;
+    if (path.len > 0 && path.ptr[0] == '/')
     {
-        cancel(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
+        path.ptr++;
+        path.len--;
     }
-    else
+
+    int seat_id = request_int_param(request, "seat");
+    int user_id = request_int_param(request, "user");
+    int customer_priority = request_int_param(request, "priority");
+    
+    // Check if the request is for one of our operations. Each one fills
+    // conn->out and falls through to a single response.
+    switch (route_lookup(&routes, path))
     {
+    case ROUTE_LIST_SEATS:
+        if (wants_seat_map(request))
+        {
+            start_seat_map(conn);
+            return;
+        }
+        if (seat_count() > 0)
+        {
+            start_seat_list(conn);
+            return;
+        }
+        list_seats(conn->out, CONN_WINDOW);
+        break;
+    case ROUTE_VIEW_SEAT:
+        view_seat(conn->out, CONN_WINDOW, seat_id, user_id, customer_priority);
+        break;
+    case ROUTE_CONFIRM:
+        confirm_seat(conn->out, CONN_WINDOW, seat_id, user_id, customer_priority);
+        break;
+    case ROUTE_CANCEL:
+        cancel(conn->out, CONN_WINDOW, seat_id, user_id, customer_priority);
+        break;
+    case ROUTE_STATS:
+        stats_format(conn->out, CONN_WINDOW);
+        break;
+    case ROUTE_SEAT_EVENTS:
+        start_seat_events(conn, allow_subscribe);
+        return;
+    default:
         // try to open the file
-        if ((fd = open(resource, O_RDONLY)) == -1)
+        fd = -1;
+        if (path.len < FILENAMESIZE && (resource = (char*) arena_alloc(arena, path.len + 1)) != NULL)
+        {
+            memcpy(resource, path.ptr, path.len);
+            resource[path.len] = '\0';
+            fd = open(resource, O_RDONLY);
+        }
+
+        if (fd == -1 || fstat(fd, &st) != 0)
         {
-            writenbytes(connfd, notok_response, strlen(notok_response));
+            if (fd != -1)
+                close(fd);
+            response_error(&conn->response, STATUS_NOT_FOUND);
+            return;
         } 
+
+        // the headers go out together with the first window of the file
+        int ret = read(fd, conn->out, CONN_WINDOW);
+        if (ret < 0)
+            ret = 0;
+        response_start(&conn->response, STATUS_OK, content_type_for(path.ptr, path.len));
+        response_body(&conn->response, conn->out, ret, st.st_size);
+        if (conn->keep_alive)
+            response_keep_alive(&conn->response);
+
+        conn->file_offset = ret;
+        conn->file_left = st.st_size - ret;
+        if (conn->file_left > 0)
+            conn->file_fd = fd;
         else
-        {
-            // send headers
-            writenbytes(connfd, ok_response, strlen(ok_response));
-            // send file
-            int ret;
-            while ( (ret = read(fd, buf, BUFSIZE)) > 0) {
-                writenbytes(connfd, buf, ret);
-            }  
-            // close file and free space
             close(fd);
-        } 
+        return;
     }
-    close(connfd);
+
+    int length = strlen(conn->out);
+    response_start(&conn->response, STATUS_OK, TYPE_HTML);
+    response_body(&conn->response, conn->out, length, length);
+    if (conn->keep_alive)
+        response_keep_alive(&conn->response);
 }
 
-int get_line(int fd, char *buf, int size)
+// Reads until the end of the request headers. Returns the number of bytes
+// in buf, or -1 if the headers don't fit or the read fails. A client that
+// closes its side early still gets whatever it sent parsed. Returns 0 if
+// the headers are not all there within timeout_ms, however slowly they
+// trickle in.
+int read_request(int fd, char *buf, int size, int timeout_ms)
 {
+    struct timespec now;
+    struct pollfd pfd;
+    long long deadline;
+    int total = 0;
+    int rc;
 
-    int i=0;
-    char c = '\0';
-    int n;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + timeout_ms;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
 
-    while((i < size-1) && (c != '\n'))
+    while (total < size)
     {
-        n = readnbytes(fd, &c, 1);
-        if (n > 0)
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rc = deadline - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+        if (rc <= 0 || (rc = poll(&pfd, 1, rc)) == 0)
+            return 0;
+        if (rc < 0)
         {
-            if (c == '\r')
-            {
-                n = readnbytes(fd, &c, 1);
-
-                if ((n > 0) && (c == '\n'))
-                {
-                    //this is an \r\n endline for request
-                    //we want to then return the line
-                    //readnbytes(fd, &c, 1);
-                    continue;
-                } 
-                else 
-                {
-                    c = '\n';
-                }
-            }
-            buf[i] = c;
-            i++;
-        } 
-        else
-        {
-            c = '\n';
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-    }
-    buf[i] = '\0';
-    return i;
-}
 
-int readnbytes(int fd,char *buf,int size)
-{
-    int rc = 0;
-    int totalread = 0;
-    while ((rc = read(fd,buf+totalread,size-totalread)) > 0)
-        totalread += rc;
+        rc = read(fd, buf + total, size - total);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            return total;
 
-    if (rc < 0)
-    {
-        return -1;
+        int end = http_header_end(buf, total + rc, total);
+        total += rc;
+        if (end > 0)
+            return end;
     }
-    else
-        return totalread;
+    return -1;
 }
 
 int writenbytes(int fd,char *str,int size)
@@ -250,40 +522,3 @@ int writenbytes(int fd,char *str,int size)
     else
         return totalwritten;
 }
-
-int parse_int_arg(char* filename, char* arg)
-{
-    int i;
-    bool found_value_start = false;
-    bool found_arg_list_start = false;
-    int seatnum = 0;
-    for(i=0; i < strlen(filename); i++)
-    {
-        if (!found_arg_list_start)
-        {
-            if (filename[i] == '?')
-            {
-                found_arg_list_start = true;
-            }
-            continue;
-        }
-        if (!found_value_start && strncmp(&filename[i], arg, strlen(arg)) == 0)
-        {
-            found_value_start = true;
-            i += strlen(arg);
-        }
-        if (found_value_start)
-        {
-            if(isdigit(filename[i]))
-            {
-                seatnum = seatnum * 10 + (int) filename[i] - (int) '0';
-                continue;
-            } 
-            else
-            {
-                break;
-            }
-        }
-    }
-    return seatnum;
-}
@@ -1,6 +1,12 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
-int handle_connection(void*);
+#include "conn.h"
+
+void init_handlers();
+void* handle_connection(void* fd);
+void serve_request(conn_t* conn);
+void shed_connection(int connfd);
+int next_window(conn_t* conn);
 
 #endif